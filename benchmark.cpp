@@ -0,0 +1,497 @@
+// Benchmark for the compressor library: runs every codec path over a fixed corpus and prints throughput,
+// compression ratio and peak memory as JSON. The corpus is generated from a fixed seed, so runs on
+// different builds or hosts compare like for like; --corpus adds real files from a directory.
+//
+// Build (after building the shared library, see README.md):
+//   g++ -std=c++17 -O2 -o benchmark benchmark.cpp -L. -lcompressor -ljpeg
+#include <bits/stdc++.h>
+#include <jpeglib.h>
+#include "compressor_api.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+using namespace std;
+
+// One input of the corpus
+struct CorpusEntry {
+    string name;
+    bool isJPEG;
+    vector<unsigned char> data;
+};
+
+// Measurements for one codec path on one corpus entry
+struct BenchmarkResult {
+    string codec;
+    string mode;
+    string input;
+    uint64_t inputBytes;
+    uint64_t outputBytes;
+    double compressSeconds;   // Median over the iterations
+    double decompressSeconds; // Median over the iterations; negative if the path has no decompressor
+    uint64_t peakRSSKiB;
+};
+
+// Peak resident set size of the process. On Linux the peak can be reset between cases, so each case
+// reports its own peak; elsewhere it is the peak of the run so far.
+class PeakMemory {
+public:
+    static void reset() {
+#ifdef __linux__
+        ofstream("/proc/self/clear_refs") << "5";
+#endif
+    }
+
+    static uint64_t peakKiB() {
+#ifdef __linux__
+        ifstream status("/proc/self/status");
+        string line;
+        while (getline(status, line)) {
+            if (line.compare(0, 6, "VmHWM:") == 0) {
+                return stoull(line.substr(6));
+            }
+        }
+#endif
+#ifdef _WIN32
+        PROCESS_MEMORY_COUNTERS counters;
+        GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters));
+        return counters.PeakWorkingSetSize / 1024;
+#else
+        rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+        return usage.ru_maxrss / 1024;
+#else
+        return usage.ru_maxrss;
+#endif
+#endif
+    }
+};
+
+// Builds the synthetic corpus. Only raw mt19937 output is used (not the std distributions), because
+// its sequence is fixed by the standard, so every platform generates the same bytes.
+class CorpusGenerator {
+    mt19937 random;
+
+    // English-like text: words drawn from a small vocabulary with a skewed (roughly Zipf) distribution
+    vector<unsigned char> wordText(size_t size) {
+        static const char* const words[] = {
+            "the", "of", "and", "to", "in", "a", "is", "that", "for", "it", "as", "was", "with", "be", "by",
+            "on", "not", "he", "this", "are", "or", "his", "from", "at", "which", "but", "have", "an", "had",
+            "they", "you", "were", "their", "one", "all", "we", "can", "her", "has", "there", "been", "if",
+            "more", "when", "will", "would", "who", "so", "no", "compression", "block", "archive", "storage"};
+        const size_t wordCount = sizeof(words) / sizeof(words[0]);
+        string text;
+        while (text.size() < size) {
+            size_t rank = random() % wordCount;
+            rank = rank * (random() % wordCount) / wordCount;
+            text += words[rank];
+            text += (random() % 12 == 0) ? ".\n" : " ";
+        }
+        text.resize(size);
+        return vector<unsigned char>(text.begin(), text.end());
+    }
+
+    // Log lines with repeated structure and a few varying fields
+    vector<unsigned char> logText(size_t size) {
+        static const char* const levels[] = {"INFO", "INFO", "INFO", "DEBUG", "WARN", "ERROR"};
+        static const char* const paths[] = {"/api/v1/items", "/api/v1/users", "/health", "/api/v1/orders"};
+        string text;
+        char line[160];
+        for (uint64_t i = 0; text.size() < size; i++) {
+            snprintf(line, sizeof(line), "2024-03-%02u %02u:%02u:%02u.%03u %s request id=%u path=%s status=%u ms=%u\n",
+                     unsigned(1 + i / 86400 % 28), unsigned(i / 3600 % 24), unsigned(i / 60 % 60), unsigned(i % 60),
+                     unsigned(random() % 1000), levels[random() % 6], unsigned(random() % 1000000),
+                     paths[random() % 4], random() % 10 ? 200u : 500u, unsigned(random() % 250));
+            text += line;
+        }
+        text.resize(size);
+        return vector<unsigned char>(text.begin(), text.end());
+    }
+
+    // Uniformly random bytes (incompressible)
+    vector<unsigned char> randomBytes(size_t size) {
+        vector<unsigned char> data(size);
+        for (unsigned char& byte : data) {
+            byte = random() & 0xFF;
+        }
+        return data;
+    }
+
+    // Bytes with a geometric distribution (few very common values, long tail)
+    vector<unsigned char> skewedBytes(size_t size) {
+        vector<unsigned char> data(size);
+        for (unsigned char& byte : data) {
+            uint32_t bits = random();
+            byte = bits ? __builtin_ctz(bits) : 32;
+        }
+        return data;
+    }
+
+    // Synthetic photo-like image (gradients, shapes and noise) encoded at quality 90
+    vector<unsigned char> jpegImage(JDIMENSION width, JDIMENSION height) {
+        vector<unsigned char> pixels(static_cast<size_t>(width) * height * 3);
+        for (JDIMENSION y = 0; y < height; y++) {
+            for (JDIMENSION x = 0; x < width; x++) {
+                unsigned char* pixel = &pixels[(static_cast<size_t>(y) * width + x) * 3];
+                int noise = random() % 24;
+                bool disc = (x - width / 3) * (x - width / 3) + (y - height / 2) * (y - height / 2) <
+                            (height / 4) * (height / 4);
+                pixel[0] = static_cast<unsigned char>(x * 200 / width + noise);
+                pixel[1] = static_cast<unsigned char>(disc ? 220 - noise : y * 180 / height + noise);
+                pixel[2] = static_cast<unsigned char>(((x / 32 + y / 32) % 2) * 90 + noise);
+            }
+        }
+
+        jpeg_compress_struct compressor;
+        jpeg_error_mgr error;
+        compressor.err = jpeg_std_error(&error);
+        jpeg_create_compress(&compressor);
+        unsigned char* buffer = nullptr;
+        unsigned long bufferSize = 0;
+        jpeg_mem_dest(&compressor, &buffer, &bufferSize);
+        compressor.image_width = width;
+        compressor.image_height = height;
+        compressor.input_components = 3;
+        compressor.in_color_space = JCS_RGB;
+        jpeg_set_defaults(&compressor);
+        jpeg_set_quality(&compressor, 90, TRUE);
+        jpeg_start_compress(&compressor, TRUE);
+        while (compressor.next_scanline < height) {
+            JSAMPROW row = &pixels[static_cast<size_t>(compressor.next_scanline) * width * 3];
+            jpeg_write_scanlines(&compressor, &row, 1);
+        }
+        jpeg_finish_compress(&compressor);
+        jpeg_destroy_compress(&compressor);
+
+        vector<unsigned char> image(buffer, buffer + bufferSize);
+        free(buffer);
+        return image;
+    }
+
+public:
+    CorpusGenerator() : random(20240301) {}
+
+    vector<CorpusEntry> generate() {
+        vector<CorpusEntry> corpus;
+        corpus.push_back({"text-words-8M", false, wordText(8 << 20)});
+        corpus.push_back({"text-logs-8M", false, logText(8 << 20)});
+        corpus.push_back({"text-record-2K", false, logText(2 << 10)});
+        corpus.push_back({"binary-random-4M", false, randomBytes(4 << 20)});
+        corpus.push_back({"binary-skewed-4M", false, skewedBytes(4 << 20)});
+        corpus.push_back({"jpeg-small-320x240", true, jpegImage(320, 240)});
+        corpus.push_back({"jpeg-large-3000x2000", true, jpegImage(3000, 2000)});
+        return corpus;
+    }
+
+    // Log text the small-record codebook is trained on; drawn after the corpus, so it differs from the
+    // records being measured
+    vector<unsigned char> codebookSample() {
+        return logText(1 << 20);
+    }
+};
+
+class Benchmark {
+    // Inputs up to this size also run through the trained codebook, which is meant for small records
+    static const size_t SMALL_RECORD_SIZE = 64 << 10;
+
+    // Times a small record over this many calls per iteration, since one call is too short to time
+    static const int RECORD_REPEATS = 1000;
+
+    int iterations;
+    filesystem::path workDir;
+    vector<BenchmarkResult> results;
+    uint32_t codebookId;
+
+    // Throws if an API call failed
+    static void check(int status, const string& what) {
+        if (status != 0) {
+            throw runtime_error(what + ": " + compressor_last_error());
+        }
+    }
+
+    static double median(vector<double> values) {
+        sort(values.begin(), values.end());
+        return values[values.size() / 2];
+    }
+
+    // Times operation iterations times and returns the median wall time in seconds
+    template <typename Operation>
+    double timeMedian(Operation operation) {
+        vector<double> seconds;
+        for (int i = 0; i < iterations; i++) {
+            auto start = chrono::steady_clock::now();
+            operation();
+            seconds.push_back(chrono::duration<double>(chrono::steady_clock::now() - start).count());
+        }
+        return median(seconds);
+    }
+
+    static vector<unsigned char> readFile(const filesystem::path& path) {
+        ifstream file(path, ios::binary);
+        return vector<unsigned char>(istreambuf_iterator<char>(file), istreambuf_iterator<char>());
+    }
+
+    static void writeFile(const filesystem::path& path, const vector<unsigned char>& data) {
+        ofstream file(path, ios::binary);
+        file.write(reinterpret_cast<const char*>(data.data()), data.size());
+    }
+
+    // Text codec on memory buffers, verifying the round trip
+    void textBuffer(const CorpusEntry& entry) {
+        PeakMemory::reset();
+        unsigned char* encoded = nullptr;
+        size_t encodedSize = 0;
+        double compressSeconds = timeMedian([&] {
+            compressor_free(encoded);
+            check(compressor_text_compress_buffer(entry.data.data(), entry.data.size(), &encoded, &encodedSize, nullptr),
+                  entry.name);
+        });
+
+        unsigned char* decoded = nullptr;
+        size_t decodedSize = 0;
+        double decompressSeconds = timeMedian([&] {
+            compressor_free(decoded);
+            check(compressor_text_decompress_buffer(encoded, encodedSize, &decoded, &decodedSize, nullptr), entry.name);
+        });
+        bool roundTrip = decodedSize == entry.data.size() && equal(entry.data.begin(), entry.data.end(), decoded);
+        compressor_free(decoded);
+        compressor_free(encoded);
+        if (!roundTrip) {
+            throw runtime_error(entry.name + ": text buffer round trip mismatch");
+        }
+        results.push_back({"text", "buffer", entry.name, entry.data.size(), encodedSize, compressSeconds,
+                           decompressSeconds, PeakMemory::peakKiB()});
+    }
+
+    // Text codec on files, as the single stream (blockSize 0) or as the block container on all cores
+    void textFile(const CorpusEntry& entry, size_t blockSize, int codec, const string& mode) {
+        filesystem::path input = workDir / "input.bin";
+        filesystem::path encoded = workDir / "encoded.bin";
+        filesystem::path decoded = workDir / "decoded.bin";
+        writeFile(input, entry.data);
+
+        PeakMemory::reset();
+        double compressSeconds = timeMedian([&] {
+            check(compressor_text_compress_file(input.string().c_str(), encoded.string().c_str(), blockSize, 0,
+                                                codec, nullptr),
+                  entry.name);
+        });
+        double decompressSeconds = timeMedian([&] {
+            check(compressor_text_decompress_file(encoded.string().c_str(), decoded.string().c_str(), 0, nullptr),
+                  entry.name);
+        });
+        if (readFile(decoded) != entry.data) {
+            throw runtime_error(entry.name + ": text file round trip mismatch");
+        }
+        results.push_back({"text", mode, entry.name, entry.data.size(),
+                           filesystem::file_size(encoded), compressSeconds, decompressSeconds, PeakMemory::peakKiB()});
+    }
+
+    // Small-record text coding with the trained codebook on memory buffers, verifying the round trip.
+    // Times are per record.
+    void textCodebook(const CorpusEntry& entry) {
+        PeakMemory::reset();
+        unsigned char* encoded = nullptr;
+        size_t encodedSize = 0;
+        double compressSeconds = timeMedian([&] {
+            for (int i = 0; i < RECORD_REPEATS; i++) {
+                compressor_free(encoded);
+                check(compressor_text_compress_codebook_buffer(codebookId, entry.data.data(), entry.data.size(),
+                                                               &encoded, &encodedSize, nullptr),
+                      entry.name);
+            }
+        }) / RECORD_REPEATS;
+
+        unsigned char* decoded = nullptr;
+        size_t decodedSize = 0;
+        double decompressSeconds = timeMedian([&] {
+            for (int i = 0; i < RECORD_REPEATS; i++) {
+                compressor_free(decoded);
+                check(compressor_text_decompress_codebook_buffer(encoded, encodedSize, &decoded, &decodedSize, nullptr),
+                      entry.name);
+            }
+        }) / RECORD_REPEATS;
+        bool roundTrip = decodedSize == entry.data.size() && equal(entry.data.begin(), entry.data.end(), decoded);
+        compressor_free(decoded);
+        compressor_free(encoded);
+        if (!roundTrip) {
+            throw runtime_error(entry.name + ": codebook round trip mismatch");
+        }
+        results.push_back({"text", "buffer-codebook", entry.name, entry.data.size(), encodedSize, compressSeconds,
+                           decompressSeconds, PeakMemory::peakKiB()});
+    }
+
+    // JPEG recompression at quality 75 and lossless optimization, both on memory buffers
+    void jpegBuffer(const CorpusEntry& entry) {
+        const struct {
+            const char* mode;
+            function<int(unsigned char**, size_t*)> run;
+        } modes[] = {
+            {"compress-q75", [&](unsigned char** out, size_t* size) {
+                 return compressor_jpeg_compress_buffer(entry.data.data(), entry.data.size(), 75, out, size, nullptr);
+             }},
+            {"optimize", [&](unsigned char** out, size_t* size) {
+                 return compressor_jpeg_optimize_buffer(entry.data.data(), entry.data.size(), 0, out, size, nullptr);
+             }},
+        };
+
+        for (const auto& mode : modes) {
+            PeakMemory::reset();
+            unsigned char* output = nullptr;
+            size_t outputSize = 0;
+            double seconds = timeMedian([&] {
+                compressor_free(output);
+                check(mode.run(&output, &outputSize), entry.name);
+            });
+            compressor_free(output);
+            results.push_back({"jpeg", mode.mode, entry.name, entry.data.size(), outputSize, seconds, -1,
+                               PeakMemory::peakKiB()});
+        }
+    }
+
+    static string jsonString(const string& value) {
+        string quoted = "\"";
+        for (char c : value) {
+            if (c == '"' || c == '\\') {
+                quoted += '\\';
+            }
+            quoted += (static_cast<unsigned char>(c) < 0x20) ? ' ' : c;
+        }
+        return quoted + "\"";
+    }
+
+    static double megabytesPerSecond(uint64_t bytes, double seconds) {
+        return seconds > 0 ? bytes / seconds / (1 << 20) : 0;
+    }
+
+    // Every block container codec, with its result mode
+    static constexpr struct {
+        int codec;
+        const char* mode;
+    } blockCodecs[] = {
+        {COMPRESSOR_CODEC_HUFFMAN, "file-blocks"},
+        {COMPRESSOR_CODEC_ORDER1, "file-blocks-order1"},
+        {COMPRESSOR_CODEC_TANS, "file-blocks-tans"},
+        {COMPRESSOR_CODEC_LZ77, "file-blocks-lz77"},
+        {COMPRESSOR_CODEC_BWT, "file-blocks-bwt"},
+    };
+
+public:
+    Benchmark(int iterations, const filesystem::path& workDir)
+        : iterations(iterations), workDir(workDir), codebookId(0) {}
+
+    // Trains the small-record codebook on sample and loads it
+    void trainCodebook(const vector<unsigned char>& sample) {
+        filesystem::path samplePath = workDir / "codebook-sample.txt";
+        filesystem::path codebookPath = workDir / "records.hfcb";
+        writeFile(samplePath, sample);
+        check(compressor_codebook_train(samplePath.string().c_str(), codebookPath.string().c_str(), &codebookId),
+              "codebook training");
+        check(compressor_codebook_load(codebookPath.string().c_str(), &codebookId), "codebook loading");
+    }
+
+    void run(const vector<CorpusEntry>& corpus) {
+        for (const CorpusEntry& entry : corpus) {
+            cerr << "benchmarking " << entry.name << endl;
+            if (entry.isJPEG) {
+                jpegBuffer(entry);
+            } else {
+                textBuffer(entry);
+                if (entry.data.size() <= SMALL_RECORD_SIZE) {
+                    textCodebook(entry);
+                }
+                textFile(entry, 0, COMPRESSOR_CODEC_HUFFMAN, "file");
+                for (const auto& blockCodec : blockCodecs) {
+                    textFile(entry, 1 << 20, blockCodec.codec, blockCodec.mode);
+                }
+            }
+        }
+    }
+
+    void writeJSON(ostream& out) const {
+        out << "{\n  \"api_version\": " << compressor_api_version() << ",\n  \"iterations\": " << iterations
+            << ",\n  \"results\": [\n";
+        for (size_t i = 0; i < results.size(); i++) {
+            const BenchmarkResult& result = results[i];
+            out << "    {\"codec\": " << jsonString(result.codec) << ", \"mode\": " << jsonString(result.mode)
+                << ", \"input\": " << jsonString(result.input) << ", \"input_bytes\": " << result.inputBytes
+                << ", \"output_bytes\": " << result.outputBytes
+                << ", \"ratio\": " << (result.inputBytes ? double(result.outputBytes) / result.inputBytes : 0)
+                << ", \"compress_seconds\": " << result.compressSeconds
+                << ", \"compress_mb_s\": " << megabytesPerSecond(result.inputBytes, result.compressSeconds);
+            if (result.decompressSeconds >= 0) {
+                out << ", \"decompress_seconds\": " << result.decompressSeconds
+                    << ", \"decompress_mb_s\": " << megabytesPerSecond(result.inputBytes, result.decompressSeconds);
+            }
+            out << ", \"peak_rss_kib\": " << result.peakRSSKiB << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+        }
+        out << "  ]\n}\n";
+    }
+};
+
+// Looks up a "--name=value" option
+bool findOption(int argc, char* argv[], const string& name, string& value) {
+    string prefix = "--" + name + "=";
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg.compare(0, prefix.size(), prefix) == 0) {
+            value = arg.substr(prefix.size());
+            return true;
+        }
+    }
+    return false;
+}
+
+int main(int argc, char* argv[]) {
+    string value;
+    int iterations = findOption(argc, argv, "iterations", value) ? stoi(value) : 5;
+    if (iterations < 1) {
+        cerr << "Usage: benchmark [--iterations=N] [--corpus=DIR] [--output=FILE]" << endl;
+        return 1;
+    }
+
+    CorpusGenerator generator;
+    vector<CorpusEntry> corpus = generator.generate();
+    if (findOption(argc, argv, "corpus", value)) {
+        vector<filesystem::path> files;
+        for (const auto& entry : filesystem::directory_iterator(value)) {
+            if (entry.is_regular_file()) {
+                files.push_back(entry.path());
+            }
+        }
+        sort(files.begin(), files.end());
+        for (const filesystem::path& file : files) {
+            string extension = file.extension().string();
+            transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+            ifstream in(file, ios::binary);
+            corpus.push_back({file.filename().string(), extension == ".jpg" || extension == ".jpeg",
+                              vector<unsigned char>(istreambuf_iterator<char>(in), istreambuf_iterator<char>())});
+        }
+    }
+
+    filesystem::path workDir = filesystem::temp_directory_path() / ("compressor-benchmark-" + to_string(time(nullptr)));
+    filesystem::create_directories(workDir);
+    Benchmark benchmark(iterations, workDir);
+    try {
+        benchmark.trainCodebook(generator.codebookSample());
+        benchmark.run(corpus);
+    } catch (const exception& e) {
+        filesystem::remove_all(workDir);
+        cerr << "Benchmark failed: " << e.what() << endl;
+        return 1;
+    }
+    filesystem::remove_all(workDir);
+
+    if (findOption(argc, argv, "output", value)) {
+        ofstream out(value);
+        benchmark.writeJSON(out);
+    } else {
+        benchmark.writeJSON(cout);
+    }
+    return 0;
+}
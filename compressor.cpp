@@ -1,423 +1,4392 @@
 #include <bits/stdc++.h>
 #include <jpeglib.h>
+#include "compressor_api.h"
+
+// Codebook header written by "text train --header"; compiles that codebook in as --codebook=builtin
+#ifdef COMPRESSOR_CODEBOOK_HEADER
+#include COMPRESSOR_CODEBOOK_HEADER
+#endif
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
 
 using namespace std;
 
-// Node class representing each character and its frequency in the Huffman Tree
-class Node {
+//Function to calculate file size
+int64_t getFileSize(const std::string& filename) {
+    std::ifstream file(filename, std::ios::binary);
+    
+    if (!file) {
+        std::cerr << "Error opening file: " << filename << std::endl;
+        return -1;
+    }
+    
+    // Move the file pointer to the end
+    file.seekg(0, std::ios::end);
+    
+    // Get the position of the file pointer (which is the file size)
+    int64_t size = file.tellg();
+    
+    // Close the file
+    file.close();
+    
+    return size;
+}
+
+// Prints the size summary shown after a file has been compressed
+void printCompressionStats(ostream& out, const string& inputFile, const string& outputFile) {
+    int64_t inputsize = getFileSize(inputFile);
+    int64_t outputsize = getFileSize(outputFile);
+    // A pipe has no size once it has been read, so only known sizes are shown
+    if (inputsize >= 0) {
+        out<<"original file size:"<<inputsize<<" bytes"<<endl;
+    }
+    out<<"compressed file size:"<<outputsize<<" bytes"<<endl;
+    if (inputsize > 0) {
+        double compressionPercentage = (static_cast<double>(outputsize) / inputsize) * 100;
+        out << "Compression Percentage: " << compressionPercentage << "%" << endl;
+    }
+}
+
+// Peak resident memory of the process so far, in KiB
+uint64_t peakMemoryKiB() {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters));
+    return counters.PeakWorkingSetSize / 1024;
+#else
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024;
+#else
+    return usage.ru_maxrss;
+#endif
+#endif
+}
+
+// Wall time spent in the named phases of one operation, reported by --stats=json. Time accumulates per
+// phase, so streaming loops can charge each step to the phase it belongs to.
+class PhaseTimer {
+    vector<pair<string, double>> phases; // Seconds per phase, in order of first use
+
+public:
+    typedef chrono::steady_clock::time_point TimePoint;
+
+    static TimePoint now() {
+        return chrono::steady_clock::now();
+    }
+
+    void clear() {
+        phases.clear();
+    }
+
+    // Charges the time since start to phase and restarts start, for timing consecutive steps
+    void lap(const char* phase, TimePoint& start) {
+        TimePoint end = now();
+        double seconds = chrono::duration<double>(end - start).count();
+        start = end;
+        for (auto& entry : phases) {
+            if (entry.first == phase) {
+                entry.second += seconds;
+                return;
+            }
+        }
+        phases.emplace_back(phase, seconds);
+    }
+
+    const vector<pair<string, double>>& results() const {
+        return phases;
+    }
+};
+
+// Prints the --stats=json summary of one operation: sizes, wall time, throughput, peak memory and phases
+void printJSONStats(ostream& out, const string& operation, const string& inputFile, const string& outputFile,
+                    double seconds, const PhaseTimer& phases) {
+    int64_t inputSize = getFileSize(inputFile);
+    int64_t outputSize = getFileSize(outputFile);
+    out << "{\"operation\": \"" << operation << "\", \"input_bytes\": " << inputSize
+        << ", \"output_bytes\": " << outputSize << ", \"seconds\": " << seconds
+        << ", \"throughput_mb_s\": " << (seconds > 0 ? inputSize / seconds / (1 << 20) : 0)
+        << ", \"peak_memory_kib\": " << peakMemoryKiB() << ", \"phases\": {";
+    const char* separator = "";
+    for (const auto& phase : phases.results()) {
+        out << separator << "\"" << phase.first << "\": " << phase.second;
+        separator = ", ";
+    }
+    out << "}}" << endl;
+}
+
+// Writes a fixed-size value to a binary stream in native byte order
+template <typename T>
+void writeBinary(ostream& out, const T& value) {
+    out.write(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+// Reads a fixed-size value written by writeBinary
+template <typename T>
+void readBinary(istream& in, T& value) {
+    in.read(reinterpret_cast<char*>(&value), sizeof(value));
+}
+
+// Writes a value in 7-bit groups, low group first, with the high bit set on all but the last byte
+void writeVarint(ostream& out, uint32_t value) {
+    while (value >= 0x80) {
+        out.put(static_cast<char>((value & 0x7F) | 0x80));
+        value >>= 7;
+    }
+    out.put(static_cast<char>(value));
+}
+
+// Number of bytes writeVarint takes for a value
+size_t varintSize(uint32_t value) {
+    size_t size = 1;
+    while (value >= 0x80) {
+        value >>= 7;
+        size++;
+    }
+    return size;
+}
+
+// Reads a value written by writeVarint
+uint32_t readVarint(istream& in) {
+    uint32_t value = 0;
+    for (int shift = 0; shift < 32; shift += 7) {
+        int byte = in.get();
+        if (byte < 0) {
+            throw runtime_error("Invalid encoded block - truncated header");
+        }
+        value |= static_cast<uint32_t>(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            return value;
+        }
+    }
+    throw runtime_error("Invalid encoded block - corrupt header");
+}
+
+// Read-only memory mapping of a whole input file, so codecs can work on its bytes without copying
+// them through stream buffers. Pages already processed can be released to keep resident memory bounded.
+// Inputs that are not regular files (pipes, devices) cannot be mapped and are read into memory instead.
+class MappedFile {
+    const unsigned char* bytes;     // Start of the mapping or of buffered (nullptr for an empty file)
+    uint64_t length;                // File size in bytes
+    vector<unsigned char> buffered; // Contents of an input that cannot be mapped (pipe, device)
+#ifdef _WIN32
+    HANDLE fileHandle;
+    HANDLE mappingHandle;
+#endif
+
+public:
+    explicit MappedFile(const string& path) : bytes(nullptr), length(0) {
+#ifdef _WIN32
+        fileHandle = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                                 FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        mappingHandle = nullptr;
+        if (fileHandle != INVALID_HANDLE_VALUE && GetFileType(fileHandle) != FILE_TYPE_DISK) {
+            // Pipes and devices have no size to map; read them to the end instead
+            char chunk[1 << 16];
+            DWORD count;
+            while (ReadFile(fileHandle, chunk, sizeof(chunk), &count, nullptr) && count > 0) {
+                buffered.insert(buffered.end(), chunk, chunk + count);
+            }
+            length = buffered.size();
+            bytes = length > 0 ? buffered.data() : nullptr;
+            return;
+        }
+        LARGE_INTEGER fileSize;
+        if (fileHandle == INVALID_HANDLE_VALUE || !GetFileSizeEx(fileHandle, &fileSize)) {
+            if (fileHandle != INVALID_HANDLE_VALUE) CloseHandle(fileHandle);
+            throw runtime_error("Cannot open input file");
+        }
+        length = fileSize.QuadPart;
+        if (length > 0) {
+            mappingHandle = CreateFileMappingA(fileHandle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            void* view = mappingHandle ? MapViewOfFile(mappingHandle, FILE_MAP_READ, 0, 0, 0) : nullptr;
+            if (!view) {
+                if (mappingHandle) CloseHandle(mappingHandle);
+                CloseHandle(fileHandle);
+                throw runtime_error("Cannot map input file");
+            }
+            bytes = static_cast<const unsigned char*>(view);
+        }
+#else
+        int fd = open(path.c_str(), O_RDONLY);
+        struct stat info;
+        if (fd < 0 || fstat(fd, &info) != 0) {
+            if (fd >= 0) close(fd);
+            throw runtime_error("Cannot open input file");
+        }
+        if (!S_ISREG(info.st_mode)) {
+            // Pipes and devices report no size and cannot be mapped; read them to the end instead
+            char chunk[1 << 16];
+            ssize_t count;
+            while ((count = read(fd, chunk, sizeof(chunk))) != 0) {
+                if (count < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (count < 0) {
+                    close(fd);
+                    throw runtime_error("Error reading input file");
+                }
+                buffered.insert(buffered.end(), chunk, chunk + count);
+            }
+            close(fd);
+            length = buffered.size();
+            bytes = length > 0 ? buffered.data() : nullptr;
+            return;
+        }
+        length = info.st_size;
+        if (length > 0) {
+            void* view = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (view == MAP_FAILED) {
+                close(fd);
+                throw runtime_error("Cannot map input file");
+            }
+            madvise(view, length, MADV_SEQUENTIAL);
+            bytes = static_cast<const unsigned char*>(view);
+        }
+        close(fd);
+#endif
+    }
+
+    ~MappedFile() {
+#ifdef _WIN32
+        if (bytes && buffered.empty()) UnmapViewOfFile(bytes);
+        if (mappingHandle) CloseHandle(mappingHandle);
+        CloseHandle(fileHandle);
+#else
+        if (bytes && buffered.empty()) munmap(const_cast<unsigned char*>(bytes), length);
+#endif
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const unsigned char* data() const {
+        return bytes;
+    }
+
+    uint64_t size() const {
+        return length;
+    }
+
+    // Tells the OS the bytes before `end` will not be read again, so their pages can be dropped
+    void releaseBefore(uint64_t end) {
+#ifndef _WIN32
+        // Buffered bytes are ordinary heap memory, which MADV_DONTNEED would zero
+        if (!buffered.empty()) {
+            return;
+        }
+        const uint64_t pageSize = sysconf(_SC_PAGESIZE);
+        uint64_t alignedEnd = min(end, length) / pageSize * pageSize;
+        if (alignedEnd > 0) {
+            madvise(const_cast<unsigned char*>(bytes), alignedEnd, MADV_DONTNEED);
+        }
+#endif
+    }
+};
+
+// Output file written through a large buffer that is handed to the OS in big chunks.
+// It is a streambuf, so header code can keep using ostream and writeBinary through out().
+class OutputFile : public streambuf {
+    FILE* file;          // Underlying unbuffered C stream
+    vector<char> buffer; // Pending output
+    ostream stream;      // ostream view over this buffer
+
+    // Writes all pending bytes to the file; returns false on I/O error
+    bool flushBuffer() {
+        size_t pending = pptr() - pbase();
+        bool ok = pending == 0 || fwrite(pbase(), 1, pending, file) == pending;
+        setp(buffer.data(), buffer.data() + buffer.size());
+        return ok;
+    }
+
+protected:
+    int overflow(int ch) override {
+        if (!flushBuffer()) {
+            return traits_type::eof();
+        }
+        if (ch != traits_type::eof()) {
+            *pptr() = static_cast<char>(ch);
+            pbump(1);
+        }
+        return traits_type::not_eof(ch);
+    }
+
+    streamsize xsputn(const char* data, streamsize size) override {
+        if (size > epptr() - pptr()) {
+            if (!flushBuffer()) {
+                return 0;
+            }
+            if (size >= static_cast<streamsize>(buffer.size())) {
+                return fwrite(data, 1, size, file);
+            }
+        }
+        memcpy(pptr(), data, size);
+        pbump(static_cast<int>(size));
+        return size;
+    }
+
+    int sync() override {
+        return flushBuffer() && fflush(file) == 0 ? 0 : -1;
+    }
+
+public:
+    explicit OutputFile(const string& path, size_t bufferSize = 4 << 20)
+        : file(fopen(path.c_str(), "wb")), buffer(bufferSize), stream(this) {
+        if (!file) {
+            throw runtime_error("Cannot open output file");
+        }
+        setvbuf(file, nullptr, _IONBF, 0);
+        setp(buffer.data(), buffer.data() + buffer.size());
+    }
+
+    ~OutputFile() {
+        if (file) {
+            flushBuffer();
+            fclose(file);
+        }
+    }
+
+    // Stream for writing to the file
+    ostream& out() {
+        return stream;
+    }
+
+    // Flushes and closes the file, throwing if any write failed
+    void close() {
+        bool ok = stream.good() && flushBuffer();
+        ok = fclose(file) == 0 && ok;
+        file = nullptr;
+        if (!ok) {
+            throw runtime_error("Error writing output file");
+        }
+    }
+};
+
+// Returns true if a packed stream of bitLength bits fits in size bytes. Whole and partial bytes are
+// counted separately, since rounding a corrupt 64-bit length up to whole bytes first could wrap around.
+bool bitsFitInBytes(uint64_t bitLength, uint64_t size) {
+    return bitLength / 8 + (bitLength % 8 != 0 ? 1 : 0) <= size;
+}
+
+// Reads a packed MSB-first bitstream from memory through a 64-bit window so that several bits can be
+// peeked at once
+class BitReader {
+    const unsigned char* data; // Packed input bytes
+    size_t size;               // Number of input bytes
+    size_t pos;                // Next byte to load into the window
+    uint64_t window;           // Buffered bits, left-aligned
+    int bitsInWindow;          // Number of valid bits in the window
+
+public:
+    BitReader(const unsigned char* data, size_t size)
+        : data(data), size(size), pos(0), window(0), bitsInWindow(0) {}
+
+    // Tops the window up to at least 57 bits; bytes past the end of input read as zero
+    void refill() {
+        while (bitsInWindow <= 56) {
+            uint64_t byte = pos < size ? data[pos] : 0;
+            window |= byte << (56 - bitsInWindow);
+            pos++;
+            bitsInWindow += 8;
+        }
+    }
+
+    // Returns how many input bytes have been loaded into the window so far
+    size_t position() const {
+        return min(pos, size);
+    }
+
+    // Returns the next n bits (1 <= n <= 32) without consuming them
+    uint32_t peek(int n) const {
+        return static_cast<uint32_t>(window >> (64 - n));
+    }
+
+    // Drops n bits from the front of the window
+    void consume(int n) {
+        window <<= n;
+        bitsInWindow -= n;
+    }
+};
+
+// Reads a bitstream written by BitWriter backwards, last value first, for coders whose decoder consumes
+// output in the reverse order of the encoder (such as ANS). Values come back exactly as written.
+class ReverseBitReader {
+    const unsigned char* data; // Packed input bytes
+    size_t pos;                // Number of bytes not yet loaded, counted from the start
+    uint64_t window;           // Buffered bits, right-aligned; the lowest bit is the next one read back
+    int bitsInWindow;          // Number of valid bits in the window
+    uint64_t bitsLeft;         // Number of written bits not yet read
+
+public:
+    // bitLength is the BitWriter::bitCount of the stream; the zero padding after it is skipped
+    ReverseBitReader(const unsigned char* data, uint64_t bitLength)
+        : data(data), pos((bitLength + 7) / 8), window(0), bitsInWindow(0), bitsLeft(bitLength) {
+        refill();
+        int padding = static_cast<int>(8 * ((bitLength + 7) / 8) - bitLength);
+        window >>= padding;
+        bitsInWindow -= padding;
+    }
+
+    // Tops the window up to at least 57 bits, or with all remaining bytes
+    void refill() {
+        while (bitsInWindow <= 56 && pos > 0) {
+            window |= static_cast<uint64_t>(data[--pos]) << bitsInWindow;
+            bitsInWindow += 8;
+        }
+    }
+
+    // Returns the value of the last n unread bits (0 <= n <= 32) and drops them
+    uint32_t read(int n) {
+        if (static_cast<uint64_t>(n) > bitsLeft) {
+            throw runtime_error("Invalid encoding - incomplete sequence");
+        }
+        uint32_t value = static_cast<uint32_t>(window & ((uint64_t(1) << n) - 1));
+        window >>= n;
+        bitsInWindow -= n;
+        bitsLeft -= n;
+        return value;
+    }
+
+    // Returns the number of written bits not yet read
+    uint64_t remaining() const {
+        return bitsLeft;
+    }
+};
+
+// Packs variable-length codes MSB-first into a 64-bit accumulator and flushes whole words to a byte buffer
+class BitWriter {
+    vector<unsigned char>& out; // Destination buffer for packed bytes
+    uint64_t accumulator;       // Pending bits, right-aligned
+    int bitsInAccumulator;      // Number of pending bits (always < 64 between calls)
+    uint64_t totalBits;         // Number of bits written so far
+
+    // Appends the full 64-bit accumulator to the output buffer in big-endian byte order
+    void flushWord() {
+        size_t offset = out.size();
+        out.resize(offset + 8);
+        for (int i = 0; i < 8; i++) {
+            out[offset + i] = static_cast<unsigned char>(accumulator >> (56 - 8 * i));
+        }
+        accumulator = 0;
+        bitsInAccumulator = 0;
+    }
+
+    // Appends up to 32 bits
+    void writeShort(uint64_t value, int length) {
+        int free = 64 - bitsInAccumulator;
+        if (length <= free) {
+            accumulator = (accumulator << length) | value;
+            bitsInAccumulator += length;
+            if (bitsInAccumulator == 64) {
+                flushWord();
+            }
+            return;
+        }
+
+        int spill = length - free;
+        accumulator = (accumulator << free) | (value >> spill);
+        bitsInAccumulator = 64;
+        flushWord();
+        accumulator = value & ((uint64_t(1) << spill) - 1);
+        bitsInAccumulator = spill;
+    }
+
+public:
+    explicit BitWriter(vector<unsigned char>& out)
+        : out(out), accumulator(0), bitsInAccumulator(0), totalBits(0) {}
+
+    // Appends the low `length` bits of value (0 <= length <= 64)
+    void write(uint64_t value, int length) {
+        if (length > 32) {
+            writeShort(value >> 32, length - 32);
+            writeShort(value & 0xFFFFFFFFu, 32);
+        } else if (length > 0) {
+            writeShort(value, length);
+        }
+        totalBits += length;
+    }
+
+    // Pads the final partial byte with zero bits and appends the remaining bytes
+    void finish() {
+        int bytes = (bitsInAccumulator + 7) / 8;
+        uint64_t aligned = bitsInAccumulator == 0 ? 0 : accumulator << (64 - bitsInAccumulator);
+        for (int i = 0; i < bytes; i++) {
+            out.push_back(static_cast<unsigned char>(aligned >> (56 - 8 * i)));
+        }
+        accumulator = 0;
+        bitsInAccumulator = 0;
+    }
+
+    // Returns the number of bits written so far
+    uint64_t bitCount() const {
+        return totalBits;
+    }
+};
+
+// Index of the highest set bit of a non-zero value
+int highBit(uint32_t value) {
+    int bit = 0;
+    while (value >>= 1) {
+        bit++;
+    }
+    return bit;
+}
+
+// Adds the byte histogram of data[0..size) to counts. Bytes are spread over four interleaved
+// 32-bit sub-tables so consecutive equal bytes do not serialise on one counter's store-to-load
+// dependency, and input is loaded eight bytes at a time. Works on any partial block.
+void countByteHistogram(const unsigned char* data, size_t size, uint64_t counts[256]) {
+    // Keeps every 32-bit sub-table counter below 2^32 between flushes into counts
+    const size_t CHUNK_SIZE = size_t(1) << 30;
+    uint32_t tables[4][256];
+
+    while (size > 0) {
+        size_t chunk = min(size, CHUNK_SIZE);
+        memset(tables, 0, sizeof(tables));
+
+        size_t i = 0;
+        for (; i + 8 <= chunk; i += 8) {
+            uint64_t word;
+            memcpy(&word, data + i, sizeof(word));
+            tables[0][word & 0xFF]++;
+            tables[1][(word >> 8) & 0xFF]++;
+            tables[2][(word >> 16) & 0xFF]++;
+            tables[3][(word >> 24) & 0xFF]++;
+            tables[0][(word >> 32) & 0xFF]++;
+            tables[1][(word >> 40) & 0xFF]++;
+            tables[2][(word >> 48) & 0xFF]++;
+            tables[3][word >> 56]++;
+        }
+        for (; i < chunk; i++) {
+            tables[0][data[i]]++;
+        }
+
+        for (int symbol = 0; symbol < 256; symbol++) {
+            counts[symbol] += static_cast<uint64_t>(tables[0][symbol]) + tables[1][symbol] +
+                              tables[2][symbol] + tables[3][symbol];
+        }
+        data += chunk;
+        size -= chunk;
+    }
+}
+
+// Read-only stream buffer over bytes already in memory, so in-memory blocks can be parsed with istream code
+class MemoryBuffer : public streambuf {
+public:
+    MemoryBuffer(const unsigned char* data, size_t size) {
+        char* begin = reinterpret_cast<char*>(const_cast<unsigned char*>(data));
+        setg(begin, begin, begin + size);
+    }
+
+    // Returns how many bytes have been read so far
+    size_t consumed() const {
+        return gptr() - eback();
+    }
+};
+
+// Fixed-size pool of worker threads that run submitted tasks in FIFO order. A pool of one thread runs
+// each task on the submitting thread instead, so single-threaded callers start no thread at all.
+class ThreadPool {
+    vector<thread> workers;            // Worker threads
+    bool runInline;                    // Set for a pool of one: tasks run inside submit()
+    queue<function<void()>> tasks;     // Tasks waiting for a worker
+    mutex queueMutex;                  // Guards tasks and stopping
+    condition_variable taskAvailable;  // Signalled when a task is queued or the pool stops
+    bool stopping;                     // Set when the pool is being destroyed
+
+    // Body of each worker: run tasks until the pool stops and the queue is drained
+    void workerLoop() {
+        while (true) {
+            function<void()> task;
+            {
+                unique_lock<mutex> lock(queueMutex);
+                taskAvailable.wait(lock, [this] { return stopping || !tasks.empty(); });
+                if (tasks.empty()) {
+                    return;
+                }
+                task = move(tasks.front());
+                tasks.pop();
+            }
+            task();
+        }
+    }
+
+public:
+    // Starts threadCount workers; 0 means one per hardware thread
+    explicit ThreadPool(size_t threadCount) : runInline(false), stopping(false) {
+        if (threadCount == 0) {
+            threadCount = max(1u, thread::hardware_concurrency());
+        }
+        runInline = threadCount == 1;
+        for (size_t i = 0; i < threadCount && !runInline; i++) {
+            workers.emplace_back(&ThreadPool::workerLoop, this);
+        }
+    }
+
+    // Finishes all queued tasks, then joins the workers
+    ~ThreadPool() {
+        {
+            lock_guard<mutex> lock(queueMutex);
+            stopping = true;
+        }
+        taskAvailable.notify_all();
+        for (thread& worker : workers) {
+            worker.join();
+        }
+    }
+
+    // Returns the number of worker threads
+    size_t size() const {
+        return runInline ? 1 : workers.size();
+    }
+
+    // Queues a task and returns a future for its result (or exception)
+    template <typename F>
+    auto submit(F task) -> future<decltype(task())> {
+        auto packaged = make_shared<packaged_task<decltype(task())()>>(move(task));
+        future<decltype(task())> result = packaged->get_future();
+        if (runInline) {
+            (*packaged)();
+            return result;
+        }
+        {
+            lock_guard<mutex> lock(queueMutex);
+            tasks.emplace([packaged] { (*packaged)(); });
+        }
+        taskAvailable.notify_one();
+        return result;
+    }
+};
+
+// Canonical, length-limited Huffman code over byte values: builds the codes from byte frequencies,
+// stores them as a compact table of code lengths, and decodes with a single table lookup per symbol
+class HuffmanTable {
+public:
+    // Longest code the encoder may assign. Keeping it equal to the decode table width means every
+    // symbol resolves in one lookup and the table (2^11 two-byte entries) stays resident in L1.
+    static constexpr int MAX_CODE_LENGTH = 11;
+
+    // Number of bits resolved by a single decode table lookup
+    static const int DECODE_TABLE_BITS = MAX_CODE_LENGTH;
+
+    // Symbols decoded per refill: a refilled window holds at least 57 bits
+    static const int SYMBOLS_PER_REFILL = 57 / MAX_CODE_LENGTH;
+
+    // Values below this are their own value code; larger values use two codes per power of two
+    static constexpr uint32_t DIRECT_VALUE_CODES = 16;
+
+    // Number of value codes, enough for any 32-bit value
+    static constexpr uint32_t VALUE_CODES = DIRECT_VALUE_CODES + 2 * (32 - 4);
+
+    // Decode table entry: the symbol whose code prefixes the looked-up bits and the code length,
+    // or length 0 when no code matches (only possible for an incomplete, single-symbol code)
+    struct DecodeEntry {
+        unsigned char symbol;
+        unsigned char length;
+    };
+
+private:
+    // Set in the table size field when the code lengths are stored as (symbol, length) pairs
+    static const uint16_t SPARSE_TABLE_FLAG = 0x8000;
+
+    uint64_t codeBits[256];          // Canonical Huffman code of each byte value, right-aligned
+    unsigned char codeLengths[256];  // Huffman code length of each byte value (0 if unused)
+    vector<DecodeEntry> decodeTable; // Lookup table indexed by the next DECODE_TABLE_BITS bits
+
+    // Turns weights sorted in ascending order into optimal code lengths, in place and in linear time,
+    // using the Moffat-Katajainen algorithm: the first pass merges the two-queue Huffman tree into
+    // parent indices, the second converts them to internal-node depths, the third to leaf depths.
+    // Needs count >= 2; afterwards weights[i] holds the code length of the i-th lightest symbol.
+    static void computeCodeLengths(uint64_t weights[], int count) {
+        int root = 0, leaf = 2, next;
+
+        weights[0] += weights[1];
+        for (next = 1; next < count - 1; next++) {
+            if (leaf >= count || weights[root] < weights[leaf]) {
+                weights[next] = weights[root];
+                weights[root++] = next;
+            } else {
+                weights[next] = weights[leaf++];
+            }
+
+            if (leaf >= count || (root < next && weights[root] < weights[leaf])) {
+                weights[next] += weights[root];
+                weights[root++] = next;
+            } else {
+                weights[next] += weights[leaf++];
+            }
+        }
+
+        weights[count - 2] = 0;
+        for (next = count - 3; next >= 0; next--) {
+            weights[next] = weights[weights[next]] + 1;
+        }
+
+        int available = 1, used = 0;
+        uint64_t depth = 0;
+        root = count - 2;
+        next = count - 1;
+        while (available > 0) {
+            while (root >= 0 && weights[root] == depth) {
+                used++;
+                root--;
+            }
+            while (available > used) {
+                weights[next--] = depth;
+                available--;
+            }
+            available = 2 * used;
+            depth++;
+            used = 0;
+        }
+    }
+
+    // Caps code lengths at MAX_CODE_LENGTH while keeping the code prefix-free (Kraft sum <= 1).
+    // sortedSymbols lists the coded symbols from least to most frequent.
+    // Over-long codes are clamped, then the least frequent shorter codes are lengthened until the
+    // code fits, and any leftover code space is handed back to the most frequent symbols.
+    void limitCodeLengths(const unsigned char sortedSymbols[], int count) {
+        const uint32_t capacity = 1u << MAX_CODE_LENGTH;
+        uint32_t kraft = 0; // Code space used, in units of 2^-MAX_CODE_LENGTH
+        bool tooLong = false;
+
+        for (int i = 0; i < count; i++) {
+            unsigned char symbol = sortedSymbols[i];
+            tooLong |= codeLengths[symbol] > MAX_CODE_LENGTH;
+            codeLengths[symbol] = min<int>(codeLengths[symbol], MAX_CODE_LENGTH);
+            kraft += capacity >> codeLengths[symbol];
+        }
+        if (!tooLong) {
+            return;
+        }
+
+        // Lengthen the least frequent of the longest codes below the limit until the code fits
+        while (kraft > capacity) {
+            int longest = 0;
+            for (int i = 0; i < count; i++) {
+                if (codeLengths[sortedSymbols[i]] < MAX_CODE_LENGTH) {
+                    longest = max<int>(longest, codeLengths[sortedSymbols[i]]);
+                }
+            }
+            for (int i = 0; i < count; i++) {
+                if (codeLengths[sortedSymbols[i]] == longest) {
+                    codeLengths[sortedSymbols[i]]++;
+                    kraft -= capacity >> codeLengths[sortedSymbols[i]];
+                    break;
+                }
+            }
+        }
+
+        // Give any remaining code space back, most frequent symbols first
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            for (int i = count - 1; i >= 0; i--) {
+                int length = codeLengths[sortedSymbols[i]];
+                if (length > 1 && kraft + (capacity >> length) <= capacity) {
+                    kraft += capacity >> length;
+                    codeLengths[sortedSymbols[i]]--;
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    // Assigns canonical codes from codeLengths: shorter codes first, ties broken by symbol value,
+    // so the code lengths alone are enough for the decoder to rebuild the exact same codes
+    void assignCanonicalCodes() {
+        int lengthCount[MAX_CODE_LENGTH + 1] = {0};
+        for (int symbol = 0; symbol < 256; symbol++) {
+            lengthCount[codeLengths[symbol]]++;
+        }
+        lengthCount[0] = 0;
+
+        uint64_t nextCode[MAX_CODE_LENGTH + 1] = {0};
+        uint64_t code = 0;
+        for (int length = 1; length <= MAX_CODE_LENGTH; length++) {
+            code = (code + lengthCount[length - 1]) << 1;
+            nextCode[length] = code;
+        }
+
+        for (int symbol = 0; symbol < 256; symbol++) {
+            int length = codeLengths[symbol];
+            codeBits[symbol] = length == 0 ? 0 : nextCode[length]++;
+        }
+    }
+
+    // Builds the decode table from the current canonical codes.
+    // Every entry whose index starts with a symbol's code maps to that symbol.
+    void buildDecodeTable() {
+        decodeTable.assign(1 << DECODE_TABLE_BITS, DecodeEntry{0, 0});
+
+        for (int symbol = 0; symbol < 256; symbol++) {
+            int length = codeLengths[symbol];
+            if (length == 0) {
+                continue;
+            }
+
+            uint32_t value = static_cast<uint32_t>(codeBits[symbol]);
+            uint32_t first = value << (DECODE_TABLE_BITS - length);
+            uint32_t last = (value + 1) << (DECODE_TABLE_BITS - length);
+            for (uint32_t i = first; i < last; i++) {
+                decodeTable[i] = DecodeEntry{static_cast<unsigned char>(symbol), static_cast<unsigned char>(length)};
+            }
+        }
+    }
+
 public:
-    char ch;            // Character
-    int freq;           // Frequency of the character
-    Node *left, *right; // Left and right child pointers
+    HuffmanTable() {
+        fill(begin(codeBits), end(codeBits), 0);
+        fill(begin(codeLengths), end(codeLengths), 0);
+    }
+
+    // Builds canonical, length-limited Huffman codes from byte frequencies without building a tree:
+    // the used symbols are sorted by frequency in a fixed array and computeCodeLengths derives their
+    // code lengths in place, so no nodes are allocated and no code strings are copied.
+    void build(const uint64_t frequencies[256]) {
+        fill(begin(codeBits), end(codeBits), 0);
+        fill(begin(codeLengths), end(codeLengths), 0);
+
+        unsigned char sortedSymbols[256];
+        int count = 0;
+        for (int symbol = 0; symbol < 256; symbol++) {
+            if (frequencies[symbol] != 0) {
+                sortedSymbols[count++] = static_cast<unsigned char>(symbol);
+            }
+        }
+        sort(sortedSymbols, sortedSymbols + count, [frequencies](unsigned char a, unsigned char b) {
+            return frequencies[a] != frequencies[b] ? frequencies[a] < frequencies[b] : a < b;
+        });
+
+        if (count == 1) {
+            // A single symbol still needs a one-bit code so that every symbol consumes input
+            codeLengths[sortedSymbols[0]] = 1;
+        } else if (count > 1) {
+            uint64_t weights[256];
+            for (int i = 0; i < count; i++) {
+                weights[i] = frequencies[sortedSymbols[i]];
+            }
+            computeCodeLengths(weights, count);
+            for (int i = 0; i < count; i++) {
+                codeLengths[sortedSymbols[i]] = static_cast<unsigned char>(min<uint64_t>(weights[i], 255));
+            }
+            limitCodeLengths(sortedSymbols, count);
+        }
+        assignCanonicalCodes();
+    }
+
+    // Returns the exact number of bits the codes take for symbols with the given frequencies
+    uint64_t encodedBitLength(const uint64_t frequencies[256]) const {
+        uint64_t bits = 0;
+        for (int symbol = 0; symbol < 256; symbol++) {
+            bits += frequencies[symbol] * codeLengths[symbol];
+        }
+        return bits;
+    }
+
+    // Code of a byte value, right-aligned
+    uint64_t code(unsigned char symbol) const {
+        return codeBits[symbol];
+    }
+
+    // Code length of a byte value, 0 if it has no code
+    int length(unsigned char symbol) const {
+        return codeLengths[symbol];
+    }
+
+    // Decode table built by readLengths, indexed by the next DECODE_TABLE_BITS bits of input
+    const DecodeEntry* decodeEntries() const {
+        return decodeTable.data();
+    }
+
+    // Splits a value (such as a length or distance) into its value code, its number of extra bits and
+    // the extra bits themselves. Values below DIRECT_VALUE_CODES are their own code; above, each power of
+    // two has two codes chosen by the bit under the leading one, and the bits below that are sent raw.
+    static unsigned char valueCode(uint32_t value, int& extraBits, uint32_t& extra) {
+        if (value < DIRECT_VALUE_CODES) {
+            extraBits = 0;
+            extra = 0;
+            return static_cast<unsigned char>(value);
+        }
+        int bit = highBit(value);
+        extraBits = bit - 1;
+        extra = value & ((1u << extraBits) - 1);
+        return static_cast<unsigned char>(DIRECT_VALUE_CODES + 2 * (bit - 4) + ((value >> extraBits) & 1));
+    }
+
+    // Number of extra bits that follow a value code
+    static int valueExtraBits(uint32_t code) {
+        return code < DIRECT_VALUE_CODES ? 0 : (code - DIRECT_VALUE_CODES) / 2 + 3;
+    }
+
+    // Writes a value as its code plus its extra bits
+    void writeValue(BitWriter& writer, uint32_t value) const {
+        int extraBits;
+        uint32_t extra;
+        unsigned char code = valueCode(value, extraBits, extra);
+        writer.write(codeBits[code], codeLengths[code]);
+        writer.write(extra, extraBits);
+    }
+
+    // Reads one symbol, checking it against the bits left in the stream; the reader must hold at least
+    // MAX_CODE_LENGTH bits
+    unsigned char readSymbol(BitReader& reader, uint64_t& bitsLeft) const {
+        DecodeEntry entry = decodeTable[reader.peek(DECODE_TABLE_BITS)];
+        if (entry.length == 0) {
+            throw runtime_error("Invalid encoding - unknown code");
+        }
+        if (entry.length > bitsLeft) {
+            throw runtime_error("Invalid encoding - incomplete sequence");
+        }
+        reader.consume(entry.length);
+        bitsLeft -= entry.length;
+        return entry.symbol;
+    }
+
+    // Reads a value written by writeValue
+    uint32_t readValue(BitReader& reader, uint64_t& bitsLeft) const {
+        reader.refill();
+        unsigned char code = readSymbol(reader, bitsLeft);
+        if (code >= VALUE_CODES) {
+            throw runtime_error("Invalid encoding - unknown code");
+        }
+        int extraBits = valueExtraBits(code);
+        if (code < DIRECT_VALUE_CODES) {
+            return code;
+        }
+        if (static_cast<uint64_t>(extraBits) > bitsLeft) {
+            throw runtime_error("Invalid encoding - incomplete sequence");
+        }
+        uint32_t extra = reader.peek(extraBits);
+        reader.consume(extraBits);
+        bitsLeft -= extraBits;
+        return ((2u | ((code - DIRECT_VALUE_CODES) & 1)) << extraBits) | extra;
+    }
+
+    // Writes the code lengths in whichever form is smaller: dense, as 4-bit lengths for byte values
+    // 0..n-1 where n is one past the largest byte value present (at most 64 bytes for ASCII text),
+    // or sparse, as (symbol, length) byte pairs flagged by SPARSE_TABLE_FLAG in the count.
+    void writeLengths(ostream& outFile) const {
+        uint16_t lengthCount = 256;
+        while (lengthCount > 0 && codeLengths[lengthCount - 1] == 0) {
+            lengthCount--;
+        }
+        uint16_t symbolCount = 256 - count(begin(codeLengths), end(codeLengths), 0);
+
+        if (2 * symbolCount < (lengthCount + 1) / 2) {
+            writeBinary(outFile, static_cast<uint16_t>(SPARSE_TABLE_FLAG | symbolCount));
+            for (int symbol = 0; symbol < lengthCount; symbol++) {
+                if (codeLengths[symbol] != 0) {
+                    outFile.put(static_cast<char>(symbol));
+                    outFile.put(static_cast<char>(codeLengths[symbol]));
+                }
+            }
+        } else {
+            writeBinary(outFile, lengthCount);
+            for (int symbol = 0; symbol < lengthCount; symbol += 2) {
+                unsigned char high = codeLengths[symbol];
+                unsigned char low = symbol + 1 < lengthCount ? codeLengths[symbol + 1] : 0;
+                outFile.put(static_cast<char>((high << 4) | low));
+            }
+        }
+    }
+
+
+    // Reads the code lengths written by writeLengths, then rebuilds the canonical codes and the
+    // decode table directly from them
+    void readLengths(istream& inFile) {
+        uint16_t lengthCount = 0;
+        readBinary(inFile, lengthCount);
+        bool sparse = (lengthCount & SPARSE_TABLE_FLAG) != 0;
+        lengthCount &= ~SPARSE_TABLE_FLAG;
+        if (!inFile || lengthCount > 256) {
+            throw runtime_error("Invalid encoded file - corrupt code table");
+        }
+
+        unsigned char lengths[256] = {0};
+        if (sparse) {
+            for (int i = 0; i < lengthCount; i++) {
+                int symbol = inFile.get();
+                int length = inFile.get();
+                if (symbol < 0 || length < 0) {
+                    throw runtime_error("Invalid encoded file - truncated header");
+                }
+                lengths[symbol] = length;
+            }
+        } else {
+            for (int symbol = 0; symbol < lengthCount; symbol += 2) {
+                int packed = inFile.get();
+                if (packed < 0) {
+                    throw runtime_error("Invalid encoded file - truncated header");
+                }
+                lengths[symbol] = packed >> 4;
+                if (symbol + 1 < 256) {
+                    lengths[symbol + 1] = packed & 0x0F;
+                }
+            }
+        }
+        setLengths(lengths);
+    }
+
+    // Sets the code lengths after checking that they form a prefix code, then rebuilds the canonical
+    // codes and the decode table from them
+    void setLengths(const unsigned char lengths[256]) {
+        uint32_t kraft = 0;
+        for (int symbol = 0; symbol < 256; symbol++) {
+            if (lengths[symbol] > MAX_CODE_LENGTH) {
+                throw runtime_error("Invalid encoded file - corrupt code table");
+            }
+            if (lengths[symbol] != 0) {
+                kraft += (1u << MAX_CODE_LENGTH) >> lengths[symbol];
+            }
+        }
+        if (kraft > (1u << MAX_CODE_LENGTH)) {
+            throw runtime_error("Invalid encoded file - corrupt code table");
+        }
+
+        copy(lengths, lengths + 256, codeLengths);
+        assignCanonicalCodes();
+        buildDecodeTable();
+    }
+};
+
+// Main class for Huffman Coding operations: encoding and decoding files
+class HuffmanCoding {
+    // Version of the single-stream file layout written by encodeToFile
+    static const unsigned char VERSION = 1;
+
+    // Size of the blocks the streaming encoder and decoder read, buffer and write at a time.
+    // Peak memory stays at a few of these blocks plus the fixed code and decode tables,
+    // no matter how large the input is.
+    static constexpr size_t STREAM_BLOCK_SIZE = 1 << 20;
+
+    uint64_t frequencies[256];                // Number of occurrences of each byte value
+    HuffmanTable table;                       // Codes for the counted frequencies
+    PhaseTimer timer;                         // Phase times of the last encodeToFile/decodeFromFile
+
+    // Adds the characters of one block of input to the frequency table
+    void buildFrequencyTable(const char* data, size_t size) {
+        countByteHistogram(reinterpret_cast<const unsigned char*>(data), size, frequencies);
+    }
+
+    // Encodes one block of input into packed bits using the per-byte code tables
+    void encodeText(const char* data, size_t size, BitWriter& writer) {
+        for (size_t i = 0; i < size; i++) {
+            unsigned char symbol = static_cast<unsigned char>(data[i]);
+            writer.write(table.code(symbol), table.length(symbol));
+        }
+    }
+
+    // Decodes symbols from the reader into out until bitsLeft reaches zero or out holds at least limit bytes.
+    // Every code fits in the decode table, so each symbol costs one lookup, and several symbols are
+    // decoded per window refill.
+    void decodeSymbols(BitReader& reader, uint64_t& bitsLeft, string& out, size_t limit) {
+        const HuffmanTable::DecodeEntry* decodeTable = table.decodeEntries();
+        while (bitsLeft > 0 && out.size() < limit) {
+            reader.refill();
+
+            for (int i = 0; i < HuffmanTable::SYMBOLS_PER_REFILL && bitsLeft > 0; i++) {
+                HuffmanTable::DecodeEntry entry = decodeTable[reader.peek(HuffmanTable::DECODE_TABLE_BITS)];
+                if (entry.length == 0) {
+                    throw runtime_error("Invalid encoding - unknown code");
+                }
+                if (entry.length > bitsLeft) {
+                    throw runtime_error("Invalid encoding - incomplete sequence");
+                }
+                out += static_cast<char>(entry.symbol);
+                reader.consume(entry.length);
+                bitsLeft -= entry.length;
+            }
+        }
+    }
+
+    // Decodes bitLength bits of the mapped input starting at payloadOffset back into the original text,
+    // writing it to out one STREAM_BLOCK_SIZE block at a time and releasing input pages already read.
+    // Fails as soon as originalSize bytes are decoded with bits still left. Returns the number of bytes decoded.
+    uint64_t decodeStream(MappedFile& input, uint64_t payloadOffset, uint64_t bitLength, uint64_t originalSize,
+                          ostream& out) {
+        BitReader reader(input.data() + payloadOffset, input.size() - payloadOffset);
+        string decodedStr;
+        decodedStr.reserve(STREAM_BLOCK_SIZE);
+        uint64_t bitsLeft = bitLength;
+        uint64_t decodedSize = 0;
+
+        PhaseTimer::TimePoint start = PhaseTimer::now();
+        while (bitsLeft > 0) {
+            if (decodedSize >= originalSize) {
+                throw runtime_error("Invalid encoded file - more data than the stored size");
+            }
+            decodeSymbols(reader, bitsLeft, decodedStr, min<uint64_t>(STREAM_BLOCK_SIZE, originalSize - decodedSize));
+            timer.lap("decode", start);
+            out.write(decodedStr.data(), decodedStr.size());
+            timer.lap("write", start);
+            decodedSize += decodedStr.size();
+            decodedStr.clear();
+            input.releaseBefore(payloadOffset + reader.position());
+        }
+        return decodedSize;
+    }
+
+    // Writes the code table followed by the 64-bit encoded bit length that precedes the packed bits
+    void writeHeader(ostream& outFile, uint64_t bitLength) {
+        table.writeLengths(outFile);
+        writeBinary(outFile, bitLength);
+    }
+
+    // Reads the header written by writeHeader, rebuilding the codes and decode table, and returns the
+    // number of encoded bits that follow
+    uint64_t readHeader(istream& inFile) {
+        table.readLengths(inFile);
+        uint64_t encodedLength = 0;
+        readBinary(inFile, encodedLength);
+        if (!inFile) {
+            throw runtime_error("Invalid encoded file - truncated header");
+        }
+        return encodedLength;
+    }
+
+public:
+    // Magic bytes identifying a single-stream file. The full stream header is the magic,
+    // a version byte and the uint64 original size, followed by the code table written by writeHeader.
+    static constexpr char MAGIC[4] = {'H', 'F', 'S', 'T'};
+
+    // Constructor initializes the HuffmanCoding object
+    HuffmanCoding() {
+        fill(begin(frequencies), end(frequencies), 0);
+    }
+    
+    // Compresses one in-memory block into a self-contained record (code lengths, bit length, packed bits)
+    void compressBlock(const char* data, size_t size, vector<unsigned char>& record) {
+        fill(begin(frequencies), end(frequencies), 0);
+        buildFrequencyTable(data, size);
+        table.build(frequencies);
+
+        ostringstream header(ios::binary);
+        writeHeader(header, table.encodedBitLength(frequencies));
+        string headerBytes = header.str();
+        record.assign(headerBytes.begin(), headerBytes.end());
+
+        BitWriter writer(record);
+        encodeText(data, size, writer);
+        writer.finish();
+    }
+
+    // Decompresses a record produced by compressBlock, appending the original bytes to out. Decoding stops
+    // once expectedSize bytes have been produced, and a record with bits left over at that point is rejected.
+    void decompressBlock(const unsigned char* data, size_t size, uint64_t expectedSize, string& out) {
+        MemoryBuffer buffer(data, size);
+        istream in(&buffer);
+        uint64_t bitsLeft = readHeader(in);
+
+        size_t offset = buffer.consumed();
+        if (!bitsFitInBytes(bitsLeft, size - offset)) {
+            throw runtime_error("Invalid encoded block - truncated data");
+        }
+
+        BitReader reader(data + offset, size - offset);
+        decodeSymbols(reader, bitsLeft, out, out.size() + expectedSize);
+        if (bitsLeft != 0) {
+            throw runtime_error("Invalid encoded block - more data than the stored size");
+        }
+    }
+
+    // Compresses an in-memory buffer into the same single-stream format encodeToFile writes
+    void encodeToBuffer(const char* data, size_t size, vector<unsigned char>& encoded) {
+        vector<unsigned char> record;
+        compressBlock(data, size, record);
+
+        // Same prefix as the file: magic, version, uint64 original size
+        const size_t prefixSize = sizeof(MAGIC) + 1 + sizeof(uint64_t);
+        uint64_t originalSize = size;
+        encoded.resize(prefixSize + record.size());
+        memcpy(encoded.data(), MAGIC, sizeof(MAGIC));
+        encoded[sizeof(MAGIC)] = VERSION;
+        memcpy(encoded.data() + sizeof(MAGIC) + 1, &originalSize, sizeof(originalSize));
+        memcpy(encoded.data() + prefixSize, record.data(), record.size());
+    }
+
+    // Decompresses a single-stream buffer written by encodeToBuffer or encodeToFile, replacing out
+    void decodeFromBuffer(const unsigned char* data, size_t size, string& out) {
+        const size_t prefixSize = sizeof(MAGIC) + 1 + sizeof(uint64_t);
+        if (size < prefixSize || !equal(MAGIC, MAGIC + sizeof(MAGIC), reinterpret_cast<const char*>(data))) {
+            throw runtime_error("Not a compressed text buffer");
+        }
+        if (data[sizeof(MAGIC)] != VERSION) {
+            throw runtime_error("Unsupported compressed file version");
+        }
+        uint64_t originalSize = 0;
+        memcpy(&originalSize, data + sizeof(MAGIC) + 1, sizeof(originalSize));
+        if (originalSize / 8 > size - prefixSize) {
+            throw runtime_error("Invalid encoded buffer - truncated data");
+        }
+
+        out.clear();
+        out.reserve(originalSize);
+        decompressBlock(data + prefixSize, size - prefixSize, originalSize, out);
+        if (out.size() != originalSize) {
+            throw runtime_error("Invalid encoded buffer - decoded size mismatch");
+        }
+    }
+
+    // Encodes input file text and saves encoded output to a file.
+    // The input is memory-mapped and scanned twice in STREAM_BLOCK_SIZE blocks (once to count, once to
+    // encode), releasing pages behind each pass, so memory use does not grow with the file size.
+    // The "read" phase only covers mapping the input; its pages are faulted in during the two passes.
+    void encodeToFile(const string& inputFile, const string& encodedFile) {
+        timer.clear();
+        PhaseTimer::TimePoint start = PhaseTimer::now();
+        MappedFile input(inputFile);
+        const char* text = reinterpret_cast<const char*>(input.data());
+        uint64_t originalSize = input.size();
+        timer.lap("read", start);
+
+        fill(begin(frequencies), end(frequencies), 0);
+        for (uint64_t offset = 0; offset < originalSize; offset += STREAM_BLOCK_SIZE) {
+            buildFrequencyTable(text + offset, min<uint64_t>(STREAM_BLOCK_SIZE, originalSize - offset));
+            input.releaseBefore(offset);
+        }
+        timer.lap("histogram", start);
+        table.build(frequencies);
+        timer.lap("tree", start);
+
+        OutputFile output(encodedFile);
+        ostream& outFile = output.out();
+        outFile.write(MAGIC, sizeof(MAGIC));
+        outFile.put(VERSION);
+        writeBinary(outFile, originalSize);
+        writeHeader(outFile, table.encodedBitLength(frequencies));
+
+        vector<unsigned char> packed;
+        packed.reserve(STREAM_BLOCK_SIZE + 8);
+        BitWriter writer(packed);
+        timer.lap("write", start);
+        for (uint64_t offset = 0; offset < originalSize; offset += STREAM_BLOCK_SIZE) {
+            encodeText(text + offset, min<uint64_t>(STREAM_BLOCK_SIZE, originalSize - offset), writer);
+            timer.lap("encode", start);
+            outFile.write(reinterpret_cast<const char*>(packed.data()), packed.size());
+            packed.clear();
+            input.releaseBefore(offset);
+            timer.lap("write", start);
+        }
+        writer.finish();
+        outFile.write(reinterpret_cast<const char*>(packed.data()), packed.size());
+        output.close();
+        timer.lap("write", start);
+    }
+
+    // Decodes the encoded file back into its original text and saves it to a file.
+    // The encoded file is memory-mapped and decoded output is written in STREAM_BLOCK_SIZE blocks.
+    void decodeFromFile(const string& encodedFile, const string& outputFile) {
+        timer.clear();
+        PhaseTimer::TimePoint start = PhaseTimer::now();
+        MappedFile input(encodedFile);
+        MemoryBuffer buffer(input.data(), input.size());
+        istream inFile(&buffer);
+
+        char magic[4];
+        inFile.read(magic, sizeof(magic));
+        if (!inFile || !equal(magic, magic + 4, MAGIC)) {
+            throw runtime_error("Not a compressed text file");
+        }
+        if (inFile.get() != VERSION) {
+            throw runtime_error("Unsupported compressed file version");
+        }
+        uint64_t originalSize = 0;
+        readBinary(inFile, originalSize);
+        timer.lap("read", start);
+        uint64_t bitLength = readHeader(inFile);
+        uint64_t payloadOffset = buffer.consumed();
+        timer.lap("table", start);
+        if (!bitsFitInBytes(bitLength, input.size() - payloadOffset)) {
+            throw runtime_error("Invalid encoded file - truncated data");
+        }
+        // Every code is 1 to MAX_CODE_LENGTH bits long
+        if (bitLength < originalSize || bitLength / HuffmanTable::MAX_CODE_LENGTH > originalSize) {
+            throw runtime_error("Invalid encoded file - bit length does not match the stored size");
+        }
+
+        OutputFile output(outputFile);
+        if (decodeStream(input, payloadOffset, bitLength, originalSize, output.out()) != originalSize) {
+            throw runtime_error("Invalid encoded file - decoded size mismatch");
+        }
+        start = PhaseTimer::now();
+        output.close();
+        timer.lap("write", start);
+    }
+
+    // Wall time per phase of the last encodeToFile or decodeFromFile
+    const PhaseTimer& phaseTimes() const {
+        return timer;
+    }
+};
+
+// Order-1 Huffman codebook trained on a sample corpus and shared by many small inputs. Like
+// ContextHuffmanCoding it codes each byte with a table chosen by the byte before it, but the 256 tables
+// come from the corpus instead of the input, so records carry no tables and skip counting and table
+// building. A context's table blends its own counts with the order-0 counts of the corpus, weighted as
+// PRIOR_WEIGHT extra samples, so rare contexts stay close to the overall statistics and every byte value
+// keeps a code even where the samples never had it. A codebook's ID is a hash of its code lengths, so
+// training on the same corpus reproduces it, and each record starts with the ID of the codebook that
+// decodes it.
+//
+// Codebook file layout: the magic, a version byte, the uint32 ID, then the HuffmanTable code lengths of
+// each context in order. Record layout: the uint32 codebook ID, the varint original size, then the bits.
+class HuffmanCodebook {
+    // Version of the codebook file layout
+    static const unsigned char VERSION = 1;
+
+    // Number of previous-byte contexts
+    static const int CONTEXT_COUNT = 256;
+
+    // Weight of the order-0 statistics in each context's table, in samples of that context
+    static constexpr double PRIOR_WEIGHT = 32;
+
+    uint32_t codebookId;         // Hash of the code lengths
+    vector<HuffmanTable> tables; // Codes and decode table of each context, built once
+
+    // FNV-1a hash of the code lengths
+    static uint32_t hashLengths(const unsigned char lengths[][256]) {
+        uint32_t hash = 2166136261u;
+        for (int context = 0; context < CONTEXT_COUNT; context++) {
+            for (int symbol = 0; symbol < 256; symbol++) {
+                hash = (hash ^ lengths[context][symbol]) * 16777619u;
+            }
+        }
+        return hash;
+    }
+
+    // Copies out the code lengths of tables, one row per context
+    static void collectLengths(const vector<HuffmanTable>& tables, unsigned char lengths[][256]) {
+        for (int context = 0; context < CONTEXT_COUNT; context++) {
+            for (int symbol = 0; symbol < 256; symbol++) {
+                lengths[context][symbol] =
+                    static_cast<unsigned char>(tables[context].length(static_cast<unsigned char>(symbol)));
+            }
+        }
+    }
+
+public:
+    // Magic bytes identifying a codebook file
+    static constexpr char MAGIC[4] = {'H', 'F', 'C', 'B'};
+
+    // Creates a codebook from the code lengths of each context, as stored in a codebook file or a
+    // compiled-in header
+    explicit HuffmanCodebook(const unsigned char lengths[][256])
+        : codebookId(hashLengths(lengths)), tables(CONTEXT_COUNT) {
+        for (int context = 0; context < CONTEXT_COUNT; context++) {
+            tables[context].setLengths(lengths[context]);
+        }
+    }
+
+    // Lists the samples at path: the file itself, or every regular file directly inside a directory
+    static vector<string> samplesAt(const string& path) {
+        vector<string> samples;
+        if (filesystem::is_directory(path)) {
+            for (const auto& entry : filesystem::directory_iterator(path)) {
+                if (entry.is_regular_file()) {
+                    samples.push_back(entry.path().string());
+                }
+            }
+        } else {
+            samples.push_back(path);
+        }
+        return samples;
+    }
+
+    // Builds a codebook from the byte pair counts of the sample files
+    static HuffmanCodebook train(const vector<string>& samplePaths) {
+        vector<uint64_t> pairs(CONTEXT_COUNT * 256, 0);
+        for (const string& path : samplePaths) {
+            MappedFile sample(path);
+            const unsigned char* bytes = sample.data();
+            unsigned int previous = 0;
+            for (uint64_t i = 0; i < sample.size(); i++) {
+                pairs[previous * 256 + bytes[i]]++;
+                previous = bytes[i];
+            }
+        }
+
+        // Order-0 counts, raised by one so that every byte value has some probability
+        double order0[256];
+        double order0Total = 0;
+        for (int symbol = 0; symbol < 256; symbol++) {
+            uint64_t count = 1;
+            for (int context = 0; context < CONTEXT_COUNT; context++) {
+                count += pairs[context * 256 + symbol];
+            }
+            order0[symbol] = static_cast<double>(count);
+            order0Total += order0[symbol];
+        }
+
+        // Blended probabilities, scaled to integer frequencies that keep every symbol coded
+        vector<HuffmanTable> trained(CONTEXT_COUNT);
+        for (int context = 0; context < CONTEXT_COUNT; context++) {
+            const uint64_t* counts = &pairs[context * 256];
+            double contextTotal = 0;
+            for (int symbol = 0; symbol < 256; symbol++) {
+                contextTotal += static_cast<double>(counts[symbol]);
+            }
+            uint64_t frequencies[256];
+            for (int symbol = 0; symbol < 256; symbol++) {
+                double probability = (counts[symbol] + PRIOR_WEIGHT * order0[symbol] / order0Total) /
+                                     (contextTotal + PRIOR_WEIGHT);
+                frequencies[symbol] = max<uint64_t>(1, llround(probability * (1ull << 32)));
+            }
+            trained[context].build(frequencies);
+        }
+
+        vector<unsigned char> lengths(CONTEXT_COUNT * 256);
+        auto rows = reinterpret_cast<unsigned char (*)[256]>(lengths.data());
+        collectLengths(trained, rows);
+        return HuffmanCodebook(rows);
+    }
+
+    // Reads a codebook file written by save
+    static HuffmanCodebook load(const string& path) {
+        MappedFile file(path);
+        MemoryBuffer buffer(file.data(), file.size());
+        istream in(&buffer);
+
+        char magic[4];
+        in.read(magic, sizeof(magic));
+        if (!in || !equal(magic, magic + 4, MAGIC)) {
+            throw runtime_error("Not a codebook file: " + path);
+        }
+        if (in.get() != VERSION) {
+            throw runtime_error("Unsupported codebook version: " + path);
+        }
+        uint32_t storedId = 0;
+        readBinary(in, storedId);
+        vector<HuffmanTable> stored(CONTEXT_COUNT);
+        for (HuffmanTable& table : stored) {
+            table.readLengths(in);
+        }
+
+        vector<unsigned char> lengths(CONTEXT_COUNT * 256);
+        auto rows = reinterpret_cast<unsigned char (*)[256]>(lengths.data());
+        collectLengths(stored, rows);
+        HuffmanCodebook codebook(rows);
+        if (!in || codebook.id() != storedId) {
+            throw runtime_error("Corrupt codebook file: " + path);
+        }
+        return codebook;
+    }
+
+    // Writes the codebook file read by load
+    void save(const string& path) const {
+        OutputFile output(path);
+        ostream& out = output.out();
+        out.write(MAGIC, sizeof(MAGIC));
+        out.put(VERSION);
+        writeBinary(out, codebookId);
+        for (const HuffmanTable& table : tables) {
+            table.writeLengths(out);
+        }
+        output.close();
+    }
+
+    // Writes a C++ header defining the code lengths as a constexpr table, one row per context. Building
+    // compressor.cpp with COMPRESSOR_CODEBOOK_HEADER naming the header compiles the codebook in as "builtin".
+    void saveHeader(const string& path) const {
+        ofstream out(path);
+        out << "// Huffman codebook " << idString(codebookId) << ", written by compressor.exe text train.\n"
+            << "// Build compressor.cpp with -DCOMPRESSOR_CODEBOOK_HEADER='\"" << filesystem::path(path).filename().string()
+            << "\"' to compile it in.\n"
+            << "constexpr uint32_t COMPRESSOR_CODEBOOK_ID = 0x" << idString(codebookId) << "u;\n"
+            << "constexpr unsigned char COMPRESSOR_CODEBOOK_LENGTHS[256][256] = {\n";
+        for (const HuffmanTable& table : tables) {
+            out << "    {";
+            for (int symbol = 0; symbol < 256; symbol++) {
+                out << (symbol == 0 ? "" : symbol % 32 == 0 ? ",\n     " : ", ")
+                    << table.length(static_cast<unsigned char>(symbol));
+            }
+            out << "},\n";
+        }
+        out << "};\n";
+        if (!out) {
+            throw runtime_error("Can't write header file: " + path);
+        }
+    }
+
+    // Codebook ID as eight hex digits, as printed by train
+    static string idString(uint32_t id) {
+        char text[9];
+        snprintf(text, sizeof(text), "%08x", id);
+        return text;
+    }
+
+    // Hash of the code lengths that records name the codebook by
+    uint32_t id() const {
+        return codebookId;
+    }
+
+    // Reads the ID of the codebook a record was compressed with
+    static uint32_t recordId(const unsigned char* data, size_t size) {
+        uint32_t id = 0;
+        if (size < sizeof(id)) {
+            throw runtime_error("Invalid codebook record - truncated header");
+        }
+        memcpy(&id, data, sizeof(id));
+        return id;
+    }
+
+    // Compresses one input into a record; see the class comment for the layout
+    void compress(const char* data, size_t size, vector<unsigned char>& record) const {
+        if (size > UINT32_MAX) {
+            throw runtime_error("Input too large for codebook compression");
+        }
+        ostringstream header(ios::binary);
+        writeBinary(header, codebookId);
+        writeVarint(header, static_cast<uint32_t>(size));
+        string headerBytes = header.str();
+        record.assign(headerBytes.begin(), headerBytes.end());
+
+        const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+        BitWriter writer(record);
+        unsigned char previous = 0;
+        for (size_t i = 0; i < size; i++) {
+            const HuffmanTable& table = tables[previous];
+            writer.write(table.code(bytes[i]), table.length(bytes[i]));
+            previous = bytes[i];
+        }
+        writer.finish();
+    }
+
+    // Decompresses a record produced by compress with this codebook, replacing out
+    void decompress(const unsigned char* data, size_t size, string& out) const {
+        uint32_t id = recordId(data, size);
+        if (id != codebookId) {
+            throw runtime_error("Record was compressed with codebook " + idString(id) + ", not " +
+                                idString(codebookId));
+        }
+        MemoryBuffer buffer(data + sizeof(id), size - sizeof(id));
+        istream in(&buffer);
+        uint32_t originalSize = readVarint(in);
+
+        // Every code takes at least one bit
+        size_t offset = sizeof(id) + buffer.consumed();
+        uint64_t bitsLeft = static_cast<uint64_t>(size - offset) * 8;
+        if (originalSize > bitsLeft) {
+            throw runtime_error("Invalid codebook record - truncated data");
+        }
+
+        const HuffmanTable::DecodeEntry* decodeTables[CONTEXT_COUNT];
+        for (int context = 0; context < CONTEXT_COUNT; context++) {
+            decodeTables[context] = tables[context].decodeEntries();
+        }
+
+        // Same loop as ContextHuffmanCoding::decompressBlock, stopping after originalSize bytes
+        out.resize(originalSize);
+        BitReader reader(data + offset, size - offset);
+        unsigned char previous = 0;
+        for (size_t i = 0; i < originalSize;) {
+            reader.refill();
+            for (int j = 0; j < HuffmanTable::SYMBOLS_PER_REFILL && i < originalSize; j++) {
+                HuffmanTable::DecodeEntry entry = decodeTables[previous][reader.peek(HuffmanTable::DECODE_TABLE_BITS)];
+                if (entry.length == 0) {
+                    throw runtime_error("Invalid encoding - unknown code");
+                }
+                if (entry.length > bitsLeft) {
+                    throw runtime_error("Invalid encoding - incomplete sequence");
+                }
+                out[i++] = static_cast<char>(entry.symbol);
+                reader.consume(entry.length);
+                bitsLeft -= entry.length;
+                previous = entry.symbol;
+            }
+        }
+    }
+
+    // Compresses a file into a single record, charging its phases to timer. The codebook is shared, so
+    // the caller owns the timer.
+    void encodeToFile(const string& inputFile, const string& encodedFile, PhaseTimer& timer) const {
+        timer.clear();
+        PhaseTimer::TimePoint start = PhaseTimer::now();
+        MappedFile input(inputFile);
+        timer.lap("read", start);
+        vector<unsigned char> record;
+        compress(reinterpret_cast<const char*>(input.data()), input.size(), record);
+        timer.lap("encode", start);
+        OutputFile output(encodedFile);
+        output.out().write(reinterpret_cast<const char*>(record.data()), record.size());
+        output.close();
+        timer.lap("write", start);
+    }
+
+    // Decompresses a file written by encodeToFile with this codebook, charging its phases to timer
+    void decodeFromFile(const string& encodedFile, const string& outputFile, PhaseTimer& timer) const {
+        timer.clear();
+        PhaseTimer::TimePoint start = PhaseTimer::now();
+        MappedFile input(encodedFile);
+        timer.lap("read", start);
+        string decoded;
+        decompress(input.data(), input.size(), decoded);
+        timer.lap("decode", start);
+        OutputFile output(outputFile);
+        output.out().write(decoded.data(), decoded.size());
+        output.close();
+        timer.lap("write", start);
+    }
+};
+
+// Codebooks loaded by this process, by ID, so callers handling many records build each codebook's tables
+// once. A codebook compiled in through COMPRESSOR_CODEBOOK_HEADER is always present as "builtin".
+class CodebookRegistry {
+    mutex lock;
+    unordered_map<uint32_t, shared_ptr<const HuffmanCodebook>> codebooks;
+
+    CodebookRegistry() {
+#ifdef COMPRESSOR_CODEBOOK_HEADER
+        HuffmanCodebook builtin(COMPRESSOR_CODEBOOK_LENGTHS);
+        if (builtin.id() != COMPRESSOR_CODEBOOK_ID) {
+            throw runtime_error("Compiled-in codebook does not match its ID");
+        }
+        add(builtin);
+#endif
+    }
+
+public:
+    static CodebookRegistry& instance() {
+        static CodebookRegistry registry;
+        return registry;
+    }
+
+    // Registers a codebook and returns the registered copy; an already registered ID is kept as is
+    shared_ptr<const HuffmanCodebook> add(const HuffmanCodebook& codebook) {
+        lock_guard<mutex> guard(lock);
+        auto& entry = codebooks[codebook.id()];
+        if (!entry) {
+            entry = make_shared<const HuffmanCodebook>(codebook);
+        }
+        return entry;
+    }
+
+    // Returns the codebook with the given ID
+    shared_ptr<const HuffmanCodebook> find(uint32_t id) {
+        lock_guard<mutex> guard(lock);
+        auto entry = codebooks.find(id);
+        if (entry == codebooks.end()) {
+            throw runtime_error("Codebook " + HuffmanCodebook::idString(id) + " is not loaded");
+        }
+        return entry->second;
+    }
+
+    // Returns the compiled-in codebook for "builtin", otherwise loads and registers a codebook file
+    shared_ptr<const HuffmanCodebook> open(const string& name) {
+        if (name == "builtin") {
+#ifdef COMPRESSOR_CODEBOOK_HEADER
+            return find(COMPRESSOR_CODEBOOK_ID);
+#else
+            throw runtime_error("No codebook compiled in; build with -DCOMPRESSOR_CODEBOOK_HEADER");
+#endif
+        }
+        return add(HuffmanCodebook::load(name));
+    }
+};
+
+// Order-1 context-modeled Huffman coding of in-memory blocks: each byte is coded with a table chosen by
+// the byte before it, so structured text pays for what usually follows each character instead of for
+// overall character frequencies. Contexts too rare to pay for their own code table share one table built
+// from their combined counts. Decoding is still one table lookup per symbol.
+//
+// Record layout: uint16 table count, a 256-bit map of the contexts with their own table, the tables as
+// HuffmanTable code lengths (own tables in context order, then the shared table if any context uses it),
+// the uint64 encoded bit length, then the packed bits.
+class ContextHuffmanCoding {
+    // Contexts seen fewer times than this always use the shared table; their own table could not
+    // repay its header
+    static const uint64_t MIN_CONTEXT_COUNT = 64;
+
+    // Number of previous-byte contexts
+    static const int CONTEXT_COUNT = 256;
+
+    vector<uint64_t> frequencies;   // Pair counts, indexed by previous byte * 256 + byte
+    vector<HuffmanTable> tables;    // Code tables; merged contexts share one of them
+    unsigned char contextTable[CONTEXT_COUNT]; // Index into tables for each previous byte
+    unsigned char ownTables[CONTEXT_COUNT / 8]; // Bit set for each context with a table of its own
+
+    // Returns true if the context has a table of its own
+    bool hasOwnTable(int context) const {
+        return (ownTables[context / 8] >> (context % 8)) & 1;
+    }
+
+    // Fills contextTable from ownTables: own tables are numbered in context order, and every other
+    // context uses the shared table after them (or table 0 when there is none; such contexts never occur)
+    void assignContextTables(size_t tableCount) {
+        unsigned char next = 0;
+        size_t ownCount = 0;
+        for (int context = 0; context < CONTEXT_COUNT; context++) {
+            ownCount += hasOwnTable(context);
+        }
+        unsigned char shared = ownCount < tableCount ? static_cast<unsigned char>(ownCount) : 0;
+        for (int context = 0; context < CONTEXT_COUNT; context++) {
+            contextTable[context] = hasOwnTable(context) ? next++ : shared;
+        }
+    }
+
+    // Counts of the bytes that follow one previous byte
+    const uint64_t* contextFrequencies(int context) const {
+        return frequencies.data() + static_cast<size_t>(context) * 256;
+    }
+
+    // Bytes needed to store a table's code lengths, for weighing a table against the bits it saves
+    static uint64_t tableBytes(const HuffmanTable& table) {
+        ostringstream lengths(ios::binary);
+        table.writeLengths(lengths);
+        return lengths.str().size();
+    }
+
+    // Chooses which contexts get their own table and builds the tables. A context keeps its own table
+    // only when its codes plus the table's header are smaller than coding it with a table built from
+    // the whole block; the rest are then merged into one table built from their combined counts.
+    void buildTables() {
+        uint64_t blockFrequencies[256] = {0};
+        uint64_t contextTotals[CONTEXT_COUNT] = {0};
+        for (int context = 0; context < CONTEXT_COUNT; context++) {
+            const uint64_t* counts = contextFrequencies(context);
+            for (int symbol = 0; symbol < 256; symbol++) {
+                blockFrequencies[symbol] += counts[symbol];
+                contextTotals[context] += counts[symbol];
+            }
+        }
+        HuffmanTable blockTable;
+        blockTable.build(blockFrequencies);
+
+        tables.clear();
+        fill(begin(ownTables), end(ownTables), 0);
+        uint64_t mergedFrequencies[256] = {0};
+        bool anyMerged = false;
+        for (int context = 0; context < CONTEXT_COUNT; context++) {
+            const uint64_t* counts = contextFrequencies(context);
+            if (contextTotals[context] >= MIN_CONTEXT_COUNT) {
+                HuffmanTable table;
+                table.build(counts);
+                uint64_t ownBits = table.encodedBitLength(counts) + 8 * tableBytes(table);
+                if (ownBits < blockTable.encodedBitLength(counts)) {
+                    ownTables[context / 8] |= 1 << (context % 8);
+                    tables.push_back(move(table));
+                    continue;
+                }
+            }
+            for (int symbol = 0; symbol < 256; symbol++) {
+                mergedFrequencies[symbol] += counts[symbol];
+            }
+            anyMerged |= contextTotals[context] != 0;
+        }
+
+        // At most 255 contexts can have their own table when any is merged, so indices fit in a byte
+        if (anyMerged || tables.empty()) {
+            HuffmanTable merged;
+            merged.build(mergedFrequencies);
+            tables.push_back(move(merged));
+        }
+        assignContextTables(tables.size());
+    }
+
+public:
+    ContextHuffmanCoding() : frequencies(CONTEXT_COUNT * 256) {
+        fill(begin(contextTable), end(contextTable), 0);
+        fill(begin(ownTables), end(ownTables), 0);
+    }
+
+    // Compresses one in-memory block into a self-contained record; see the class comment for the layout
+    void compressBlock(const char* data, size_t size, vector<unsigned char>& record) {
+        const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+        fill(frequencies.begin(), frequencies.end(), 0);
+        unsigned int previous = 0;
+        for (size_t i = 0; i < size; i++) {
+            frequencies[previous * 256 + bytes[i]]++;
+            previous = bytes[i];
+        }
+        buildTables();
+
+        uint64_t bitLength = 0;
+        for (int context = 0; context < CONTEXT_COUNT; context++) {
+            bitLength += tables[contextTable[context]].encodedBitLength(contextFrequencies(context));
+        }
+
+        ostringstream header(ios::binary);
+        writeBinary(header, static_cast<uint16_t>(tables.size()));
+        header.write(reinterpret_cast<const char*>(ownTables), sizeof(ownTables));
+        for (const HuffmanTable& table : tables) {
+            table.writeLengths(header);
+        }
+        writeBinary(header, bitLength);
+        string headerBytes = header.str();
+        record.assign(headerBytes.begin(), headerBytes.end());
+
+        const HuffmanTable* tableFor[CONTEXT_COUNT];
+        for (int context = 0; context < CONTEXT_COUNT; context++) {
+            tableFor[context] = &tables[contextTable[context]];
+        }
+        BitWriter writer(record);
+        previous = 0;
+        for (size_t i = 0; i < size; i++) {
+            const HuffmanTable& table = *tableFor[previous];
+            writer.write(table.code(bytes[i]), table.length(bytes[i]));
+            previous = bytes[i];
+        }
+        writer.finish();
+    }
+
+    // Decompresses a record produced by compressBlock, appending the original bytes to out. Decoding stops
+    // once expectedSize bytes have been produced, and a record with bits left over at that point is rejected.
+    void decompressBlock(const unsigned char* data, size_t size, uint64_t expectedSize, string& out) {
+        MemoryBuffer buffer(data, size);
+        istream in(&buffer);
+        uint16_t tableCount = 0;
+        readBinary(in, tableCount);
+        in.read(reinterpret_cast<char*>(ownTables), sizeof(ownTables));
+        size_t ownCount = 0;
+        for (int context = 0; context < CONTEXT_COUNT; context++) {
+            ownCount += hasOwnTable(context);
+        }
+        if (!in || tableCount == 0 || tableCount > CONTEXT_COUNT || ownCount > tableCount ||
+            tableCount > ownCount + 1) {
+            throw runtime_error("Invalid encoded block - corrupt context map");
+        }
+        assignContextTables(tableCount);
+        tables.assign(tableCount, HuffmanTable());
+        for (HuffmanTable& table : tables) {
+            table.readLengths(in);
+        }
+        uint64_t bitsLeft = 0;
+        readBinary(in, bitsLeft);
+        if (!in) {
+            throw runtime_error("Invalid encoded block - truncated header");
+        }
+
+        size_t offset = buffer.consumed();
+        if (!bitsFitInBytes(bitsLeft, size - offset)) {
+            throw runtime_error("Invalid encoded block - truncated data");
+        }
+
+        const HuffmanTable::DecodeEntry* decodeTables[CONTEXT_COUNT];
+        for (int context = 0; context < CONTEXT_COUNT; context++) {
+            decodeTables[context] = tables[contextTable[context]].decodeEntries();
+        }
+
+        // Same loop as HuffmanCoding::decodeSymbols, with the table picked by the last decoded byte
+        BitReader reader(data + offset, size - offset);
+        unsigned char previous = 0;
+        size_t limit = out.size() + expectedSize;
+        while (bitsLeft > 0 && out.size() < limit) {
+            reader.refill();
+
+            for (int i = 0; i < HuffmanTable::SYMBOLS_PER_REFILL && bitsLeft > 0; i++) {
+                HuffmanTable::DecodeEntry entry = decodeTables[previous][reader.peek(HuffmanTable::DECODE_TABLE_BITS)];
+                if (entry.length == 0) {
+                    throw runtime_error("Invalid encoding - unknown code");
+                }
+                if (entry.length > bitsLeft) {
+                    throw runtime_error("Invalid encoding - incomplete sequence");
+                }
+                out += static_cast<char>(entry.symbol);
+                reader.consume(entry.length);
+                bitsLeft -= entry.length;
+                previous = entry.symbol;
+            }
+        }
+        if (bitsLeft != 0) {
+            throw runtime_error("Invalid encoded block - more data than the stored size");
+        }
+    }
+};
+
+// Table-based asymmetric numeral systems (tANS) coding of in-memory blocks, in the style of FSE. Byte
+// frequencies are normalized to TABLE_SIZE slots and spread over a state table, and each byte costs a
+// fractional number of bits close to its entropy, which Huffman's whole-bit codes cannot reach on skewed
+// data. Encoding and decoding are one table lookup and one variable-length bit read or write per byte.
+//
+// The encoder runs over the block backwards and the decoder reads the bits backwards (ReverseBitReader),
+// so the block decodes front to back. Record layout: the normalized counts (see writeCounts), the uint64
+// byte count, the uint64 bit length, then the packed bits (ending with the encoder's final state).
+class TANSCoding {
+    // log2 of the number of states; 4096 states keep the decode table (4 bytes a state) in L1
+    static const int TABLE_LOG = 12;
+    static const uint32_t TABLE_SIZE = 1u << TABLE_LOG;
+
+    // Symbols decoded per refill: each reads at most TABLE_LOG bits of a window holding at least 57
+    static const int SYMBOLS_PER_REFILL = 57 / TABLE_LOG;
+
+    // Encoder transform of one symbol: the bit count to emit is (state + deltaBits) >> 16, and the
+    // next state is found at (state >> bits) + deltaState in stateTable
+    struct SymbolTransform {
+        uint32_t deltaBits;
+        int32_t deltaState;
+    };
+
+    // Decoder state: the symbol it yields, how many bits to read, and the base of the next state
+    struct DecodeEntry {
+        uint16_t nextBase;
+        unsigned char symbol;
+        unsigned char bits;
+    };
+
+    uint64_t frequencies[256];          // Number of occurrences of each byte value
+    uint32_t normalized[256];           // Frequencies scaled to sum to TABLE_SIZE; >= 1 for every used byte
+    unsigned char spread[TABLE_SIZE];   // Symbol owning each state slot
+    uint16_t stateTable[TABLE_SIZE];    // Encoder next states, grouped by symbol
+    SymbolTransform transforms[256];    // Encoder transform of each byte value
+    vector<DecodeEntry> decodeTable;    // Decoder entry of each state
+
+    // Set in the count table size when the counts are stored as (symbol, count) pairs
+    static const uint16_t SPARSE_TABLE_FLAG = 0x8000;
+
+    // Scales the frequencies to sum to TABLE_SIZE, keeping every used byte at 1 or more. Rounding
+    // error is settled one slot at a time on the largest counts, where it costs the least.
+    void normalizeFrequencies(uint64_t total) {
+        int64_t sum = 0;
+        for (int symbol = 0; symbol < 256; symbol++) {
+            uint64_t count = frequencies[symbol];
+            normalized[symbol] = count == 0 ? 0 : max<uint64_t>(1, (count * TABLE_SIZE + total / 2) / total);
+            sum += normalized[symbol];
+        }
+
+        while (sum != TABLE_SIZE) {
+            int largest = -1;
+            for (int symbol = 0; symbol < 256; symbol++) {
+                if ((sum < TABLE_SIZE || normalized[symbol] > 1) &&
+                    (largest < 0 || normalized[symbol] > normalized[largest])) {
+                    largest = symbol;
+                }
+            }
+            if (sum < TABLE_SIZE) {
+                normalized[largest]++;
+                sum++;
+            } else {
+                normalized[largest]--;
+                sum--;
+            }
+        }
+    }
+
+    // Spreads the symbols over the state slots with FSE's fixed odd step, which visits every slot once
+    // and interleaves each symbol's states; encoder and decoder derive the same spread from the counts
+    void spreadSymbols() {
+        const uint32_t step = (TABLE_SIZE >> 1) + (TABLE_SIZE >> 3) + 3;
+        uint32_t position = 0;
+        for (int symbol = 0; symbol < 256; symbol++) {
+            for (uint32_t i = 0; i < normalized[symbol]; i++) {
+                spread[position] = static_cast<unsigned char>(symbol);
+                position = (position + step) & (TABLE_SIZE - 1);
+            }
+        }
+    }
+
+    // Builds stateTable and transforms for encoding from the normalized counts
+    void buildEncodeTables() {
+        spreadSymbols();
+
+        uint32_t cumulative[257];
+        cumulative[0] = 0;
+        for (int symbol = 0; symbol < 256; symbol++) {
+            cumulative[symbol + 1] = cumulative[symbol] + normalized[symbol];
+        }
+        uint32_t next[256];
+        copy(cumulative, cumulative + 256, next);
+        for (uint32_t slot = 0; slot < TABLE_SIZE; slot++) {
+            stateTable[next[spread[slot]]++] = static_cast<uint16_t>(TABLE_SIZE + slot);
+        }
+
+        for (int symbol = 0; symbol < 256; symbol++) {
+            uint32_t count = normalized[symbol];
+            if (count == 0) {
+                transforms[symbol] = SymbolTransform{0, 0};
+            } else if (count == 1) {
+                transforms[symbol] = SymbolTransform{(TABLE_LOG << 16) - TABLE_SIZE,
+                                                     static_cast<int32_t>(cumulative[symbol]) - 1};
+            } else {
+                uint32_t maxBits = TABLE_LOG - highBit(count - 1);
+                transforms[symbol] = SymbolTransform{(maxBits << 16) - (count << maxBits),
+                                                     static_cast<int32_t>(cumulative[symbol] - count)};
+            }
+        }
+    }
+
+    // Builds the decoder table from the normalized counts
+    void buildDecodeTable() {
+        spreadSymbols();
+
+        uint32_t next[256];
+        copy(normalized, normalized + 256, next);
+        decodeTable.resize(TABLE_SIZE);
+        for (uint32_t slot = 0; slot < TABLE_SIZE; slot++) {
+            unsigned char symbol = spread[slot];
+            uint32_t state = next[symbol]++;
+            int bits = TABLE_LOG - highBit(state);
+            decodeTable[slot] = DecodeEntry{static_cast<uint16_t>((state << bits) - TABLE_SIZE), symbol,
+                                            static_cast<unsigned char>(bits)};
+        }
+    }
+
+    // Writes the normalized counts in whichever form is smaller: dense, as a uint16 n and varint counts
+    // for byte values 0..n-1, or sparse, as (symbol, varint count) pairs flagged by SPARSE_TABLE_FLAG
+    void writeCounts(ostream& out) const {
+        uint16_t countSize = 256;
+        while (countSize > 0 && normalized[countSize - 1] == 0) {
+            countSize--;
+        }
+        uint16_t symbolCount = 0;
+        size_t denseSize = 0, sparseSize = 0;
+        for (int symbol = 0; symbol < countSize; symbol++) {
+            denseSize += varintSize(normalized[symbol]);
+            if (normalized[symbol] != 0) {
+                symbolCount++;
+                sparseSize += 1 + varintSize(normalized[symbol]);
+            }
+        }
+
+        if (sparseSize < denseSize) {
+            writeBinary(out, static_cast<uint16_t>(SPARSE_TABLE_FLAG | symbolCount));
+            for (int symbol = 0; symbol < countSize; symbol++) {
+                if (normalized[symbol] != 0) {
+                    out.put(static_cast<char>(symbol));
+                    writeVarint(out, normalized[symbol]);
+                }
+            }
+        } else {
+            writeBinary(out, countSize);
+            for (int symbol = 0; symbol < countSize; symbol++) {
+                writeVarint(out, normalized[symbol]);
+            }
+        }
+    }
+
+    // Reads the counts written by writeCounts and returns their sum
+    uint64_t readCounts(istream& in) {
+        uint16_t countSize = 0;
+        readBinary(in, countSize);
+        bool sparse = (countSize & SPARSE_TABLE_FLAG) != 0;
+        countSize &= ~SPARSE_TABLE_FLAG;
+        if (!in || countSize > 256) {
+            throw runtime_error("Invalid encoded block - corrupt frequency table");
+        }
+
+        fill(begin(normalized), end(normalized), 0);
+        uint64_t sum = 0;
+        for (int i = 0; i < countSize; i++) {
+            int symbol = i;
+            if (sparse && (symbol = in.get()) < 0) {
+                throw runtime_error("Invalid encoded block - truncated header");
+            }
+            normalized[symbol] = readVarint(in);
+            sum += normalized[symbol];
+        }
+        return sum;
+    }
+
+public:
+    TANSCoding() {
+        fill(begin(frequencies), end(frequencies), 0);
+        fill(begin(normalized), end(normalized), 0);
+    }
+
+    // Compresses one in-memory block into a self-contained record; see the class comment for the layout
+    void compressBlock(const char* data, size_t size, vector<unsigned char>& record) {
+        const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+        fill(begin(frequencies), end(frequencies), 0);
+        countByteHistogram(bytes, size, frequencies);
+        fill(begin(normalized), end(normalized), 0);
+        if (size > 0) {
+            normalizeFrequencies(size);
+        }
+        buildEncodeTables();
+
+        ostringstream header(ios::binary);
+        writeCounts(header);
+        writeBinary(header, static_cast<uint64_t>(size));
+        string headerBytes = header.str();
+        size_t bitLengthOffset = headerBytes.size();
+        record.assign(headerBytes.begin(), headerBytes.end());
+        record.resize(bitLengthOffset + sizeof(uint64_t));
+
+        BitWriter writer(record);
+        if (size > 0) {
+            uint32_t state = TABLE_SIZE;
+            for (size_t i = size; i-- > 0;) {
+                const SymbolTransform& transform = transforms[bytes[i]];
+                int bits = (state + transform.deltaBits) >> 16;
+                writer.write(state & ((1u << bits) - 1), bits);
+                state = stateTable[(state >> bits) + transform.deltaState];
+            }
+            writer.write(state - TABLE_SIZE, TABLE_LOG);
+        }
+        writer.finish();
+        uint64_t bitLength = writer.bitCount();
+        memcpy(record.data() + bitLengthOffset, &bitLength, sizeof(bitLength));
+    }
+
+    // Decompresses a record produced by compressBlock, appending the original bytes to out. A record whose
+    // stored size is not expectedSize is rejected before anything is decoded.
+    void decompressBlock(const unsigned char* data, size_t size, uint64_t expectedSize, string& out) {
+        MemoryBuffer buffer(data, size);
+        istream in(&buffer);
+        uint64_t sum = readCounts(in);
+        uint64_t count = 0, bitLength = 0;
+        readBinary(in, count);
+        readBinary(in, bitLength);
+        if (!in) {
+            throw runtime_error("Invalid encoded block - truncated header");
+        }
+        if (count != expectedSize) {
+            throw runtime_error("Invalid encoded block - size mismatch");
+        }
+        if (count == 0) {
+            return;
+        }
+        if (sum != TABLE_SIZE) {
+            throw runtime_error("Invalid encoded block - corrupt frequency table");
+        }
+
+        size_t offset = buffer.consumed();
+        if (!bitsFitInBytes(bitLength, size - offset) || bitLength < TABLE_LOG) {
+            throw runtime_error("Invalid encoded block - truncated data");
+        }
+        buildDecodeTable();
+
+        ReverseBitReader reader(data + offset, bitLength);
+        uint32_t state = reader.read(TABLE_LOG);
+        uint64_t decoded = 0;
+        while (decoded < count) {
+            reader.refill();
+
+            for (int i = 0; i < SYMBOLS_PER_REFILL && decoded < count; i++, decoded++) {
+                DecodeEntry entry = decodeTable[state];
+                out += static_cast<char>(entry.symbol);
+                state = entry.nextBase + reader.read(entry.bits);
+            }
+        }
+        if (reader.remaining() != 0) {
+            throw runtime_error("Invalid encoding - trailing bits");
+        }
+    }
+};
+
+// LZ77 coding of in-memory blocks, DEFLATE-style: a hash-chain match finder with one step of lazy
+// matching turns the block into sequences (a run of literal bytes, then a copy of earlier output),
+// and four Huffman tables code the literal bytes, the literal run lengths, the match lengths and the
+// match distances. Lengths and distances are coded as a bucket symbol plus raw extra bits (see
+// HuffmanTable::valueCode), so every alphabet fits a HuffmanTable and decoding stays one lookup per symbol.
+//
+// Record layout: the code lengths of the four tables (literals, run lengths, match lengths, distances),
+// the uint64 original size, the uint64 sequence count, the uint64 bit length, then the packed bits. Each
+// sequence is its run length, its literals, then its match length and distance; the last sequence has
+// no match and carries the trailing literals.
+class LZ77Coding {
+    // Shortest match worth a sequence, and the number of bytes hashed to find candidates
+    static const uint32_t MIN_MATCH = 4;
+
+    // Matches this long are taken at once, without searching further or trying the next position
+    static const uint32_t NICE_LENGTH = 128;
+
+    // Candidates examined per position; bounds the time spent on highly repetitive input
+    static const int MAX_CHAIN = 32;
+
+    // Hash table size (log2) and match window size (log2); matches reach back at most 256 KiB
+    static const int HASH_LOG = 16;
+    static const int WINDOW_LOG = 18;
+    static const uint32_t WINDOW_SIZE = 1u << WINDOW_LOG;
+
+    // Largest block; the hash chains hold positions as int32
+    static const uint64_t MAX_BLOCK_SIZE = INT32_MAX;
+
+    // One literal run followed by one match (matchLength 0 for the final, match-less sequence)
+    struct Sequence {
+        uint32_t literalLength;
+        uint32_t matchLength;
+        uint32_t distance;
+    };
+
+    vector<int32_t> head;  // Most recent position with each hash, or -1
+    vector<int32_t> chain; // Previous position with the same hash, indexed by position % WINDOW_SIZE
+
+    // Hash of the MIN_MATCH bytes at data
+    static uint32_t hashAt(const unsigned char* data) {
+        uint32_t word;
+        memcpy(&word, data, sizeof(word));
+        return (word * 2654435761u) >> (32 - HASH_LOG);
+    }
+
+    // Adds the position to the hash chains
+    void insert(const unsigned char* data, size_t size, size_t pos) {
+        if (pos + MIN_MATCH <= size) {
+            uint32_t hash = hashAt(data + pos);
+            chain[pos & (WINDOW_SIZE - 1)] = head[hash];
+            head[hash] = static_cast<int32_t>(pos);
+        }
+    }
+
+    // Finds the longest earlier match for the bytes at pos within the window, walking at most MAX_CHAIN
+    // candidates; length stays 0 when there is none of at least MIN_MATCH bytes
+    void findMatch(const unsigned char* data, size_t size, size_t pos, uint32_t& length, uint32_t& distance) const {
+        length = 0;
+        if (pos + MIN_MATCH > size) {
+            return;
+        }
+        uint32_t maxLength = static_cast<uint32_t>(min<size_t>(size - pos, UINT32_MAX));
+        uint32_t bestLength = MIN_MATCH - 1;
+        int32_t candidate = head[hashAt(data + pos)];
+        for (int steps = 0; steps < MAX_CHAIN && candidate >= 0 && pos - candidate < WINDOW_SIZE; steps++) {
+            const unsigned char* match = data + candidate;
+            if (match[bestLength] == data[pos + bestLength]) {
+                // Compare eight bytes at a time, then find the first difference
+                uint32_t matched = 0;
+                while (matched + 8 <= maxLength) {
+                    uint64_t a, b;
+                    memcpy(&a, match + matched, sizeof(a));
+                    memcpy(&b, data + pos + matched, sizeof(b));
+                    if (a != b) {
+                        break;
+                    }
+                    matched += 8;
+                }
+                while (matched < maxLength && match[matched] == data[pos + matched]) {
+                    matched++;
+                }
+                if (matched > bestLength) {
+                    bestLength = matched;
+                    length = matched;
+                    distance = static_cast<uint32_t>(pos - candidate);
+                    if (matched >= NICE_LENGTH || matched == maxLength) {
+                        break;
+                    }
+                }
+            }
+            candidate = chain[candidate & (WINDOW_SIZE - 1)];
+        }
+    }
+
+    // Parses the block into sequences, lazily: a match is only taken if the match at the next byte
+    // is not longer, in which case the current byte becomes a literal instead
+    void findSequences(const unsigned char* data, size_t size, vector<Sequence>& sequences) {
+        fill(head.begin(), head.end(), -1);
+        size_t pos = 0, literalStart = 0;
+        uint32_t pendingLength = 0, pendingDistance = 0; // Best match starting at pos - 1
+        while (pos <= size) {
+            uint32_t length = 0, distance = 0;
+            if (pos < size) {
+                if (pendingLength < NICE_LENGTH) {
+                    findMatch(data, size, pos, length, distance);
+                }
+                insert(data, size, pos);
+            }
+
+            if (pendingLength >= MIN_MATCH && pendingLength >= length) {
+                size_t matchStart = pos - 1;
+                size_t matchEnd = matchStart + pendingLength;
+                sequences.push_back(Sequence{static_cast<uint32_t>(matchStart - literalStart), pendingLength,
+                                             pendingDistance});
+                for (size_t next = pos + 1; next < matchEnd; next++) {
+                    insert(data, size, next);
+                }
+                pos = matchEnd;
+                literalStart = matchEnd;
+                pendingLength = 0;
+                continue;
+            }
+            if (pos == size) {
+                break;
+            }
+            pendingLength = length;
+            pendingDistance = distance;
+            pos++;
+        }
+        sequences.push_back(Sequence{static_cast<uint32_t>(size - literalStart), 0, 0});
+    }
+
+    // Exact bits for coding the sequences with codes built from their counts, tables excluded
+    static uint64_t sequenceBits(const HuffmanTable tables[4], const uint64_t frequencies[4][256]) {
+        uint64_t bits = 0;
+        for (int stream = 0; stream < 4; stream++) {
+            bits += tables[stream].encodedBitLength(frequencies[stream]);
+            for (uint32_t code = 0; code < HuffmanTable::VALUE_CODES && stream > 0; code++) {
+                bits += frequencies[stream][code] * HuffmanTable::valueExtraBits(code);
+            }
+        }
+        return bits;
+    }
+
+    // Counts the symbols of every stream and builds their codes
+    static void buildTables(const unsigned char* data, const vector<Sequence>& sequences, HuffmanTable tables[4],
+                            uint64_t frequencies[4][256]) {
+        for (int stream = 0; stream < 4; stream++) {
+            fill(frequencies[stream], frequencies[stream] + 256, 0);
+        }
+        int extraBits;
+        uint32_t extra;
+        size_t pos = 0;
+        for (const Sequence& sequence : sequences) {
+            countByteHistogram(data + pos, sequence.literalLength, frequencies[0]);
+            frequencies[1][HuffmanTable::valueCode(sequence.literalLength, extraBits, extra)]++;
+            if (sequence.matchLength != 0) {
+                frequencies[2][HuffmanTable::valueCode(sequence.matchLength - MIN_MATCH, extraBits, extra)]++;
+                frequencies[3][HuffmanTable::valueCode(sequence.distance - 1, extraBits, extra)]++;
+            }
+            pos += sequence.literalLength + sequence.matchLength;
+        }
+        for (int stream = 0; stream < 4; stream++) {
+            tables[stream].build(frequencies[stream]);
+        }
+    }
+
+public:
+    LZ77Coding() : head(1 << HASH_LOG), chain(WINDOW_SIZE) {}
+
+    // Compresses one in-memory block into a self-contained record; see the class comment for the layout
+    void compressBlock(const char* data, size_t size, vector<unsigned char>& record) {
+        if (size > MAX_BLOCK_SIZE) {
+            throw runtime_error("Block too large for LZ77 coding");
+        }
+        const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+        vector<Sequence> sequences;
+        findSequences(bytes, size, sequences);
+        HuffmanTable tables[4];
+        uint64_t frequencies[4][256];
+        buildTables(bytes, sequences, tables, frequencies);
+
+        // Short matches can cost more than the literals they replace on data with few repeats but a
+        // skewed byte distribution; then the whole block is sent as one literal run instead
+        vector<Sequence> literalsOnly{Sequence{static_cast<uint32_t>(size), 0, 0}};
+        HuffmanTable literalTables[4];
+        uint64_t literalFrequencies[4][256];
+        buildTables(bytes, literalsOnly, literalTables, literalFrequencies);
+        if (sequenceBits(literalTables, literalFrequencies) <= sequenceBits(tables, frequencies)) {
+            sequences.swap(literalsOnly);
+            copy(literalTables, literalTables + 4, tables);
+        }
+        const HuffmanTable& literals = tables[0];
+        const HuffmanTable& literalLengths = tables[1];
+        const HuffmanTable& matchLengths = tables[2];
+        const HuffmanTable& distances = tables[3];
+
+        ostringstream header(ios::binary);
+        literals.writeLengths(header);
+        literalLengths.writeLengths(header);
+        matchLengths.writeLengths(header);
+        distances.writeLengths(header);
+        writeBinary(header, static_cast<uint64_t>(size));
+        writeBinary(header, static_cast<uint64_t>(sequences.size()));
+        string headerBytes = header.str();
+        size_t bitLengthOffset = headerBytes.size();
+        record.assign(headerBytes.begin(), headerBytes.end());
+        record.resize(bitLengthOffset + sizeof(uint64_t));
+
+        BitWriter writer(record);
+        size_t pos = 0;
+        for (const Sequence& sequence : sequences) {
+            literalLengths.writeValue(writer, sequence.literalLength);
+            for (size_t end = pos + sequence.literalLength; pos < end; pos++) {
+                writer.write(literals.code(bytes[pos]), literals.length(bytes[pos]));
+            }
+            if (sequence.matchLength != 0) {
+                matchLengths.writeValue(writer, sequence.matchLength - MIN_MATCH);
+                distances.writeValue(writer, sequence.distance - 1);
+                pos += sequence.matchLength;
+            }
+        }
+        writer.finish();
+        uint64_t bitLength = writer.bitCount();
+        memcpy(record.data() + bitLengthOffset, &bitLength, sizeof(bitLength));
+    }
+
+    // Decompresses a record produced by compressBlock, appending the original bytes to out. A record whose
+    // stored size is not expectedSize is rejected before anything is decoded.
+    void decompressBlock(const unsigned char* data, size_t size, uint64_t expectedSize, string& out) {
+        MemoryBuffer buffer(data, size);
+        istream in(&buffer);
+        HuffmanTable literals, literalLengths, matchLengths, distances;
+        literals.readLengths(in);
+        literalLengths.readLengths(in);
+        matchLengths.readLengths(in);
+        distances.readLengths(in);
+        uint64_t originalSize = 0, sequenceCount = 0, bitsLeft = 0;
+        readBinary(in, originalSize);
+        readBinary(in, sequenceCount);
+        readBinary(in, bitsLeft);
+        if (!in) {
+            throw runtime_error("Invalid encoded block - truncated header");
+        }
+        if (originalSize != expectedSize) {
+            throw runtime_error("Invalid encoded block - size mismatch");
+        }
+
+        size_t offset = buffer.consumed();
+        if (!bitsFitInBytes(bitsLeft, size - offset) || originalSize > MAX_BLOCK_SIZE) {
+            throw runtime_error("Invalid encoded block - truncated data");
+        }
+        // Every sequence codes at least its literal run length, and all but the last end in a match of at
+        // least MIN_MATCH bytes
+        if (sequenceCount > bitsLeft || sequenceCount > originalSize / MIN_MATCH + 1) {
+            throw runtime_error("Invalid encoded block - bad sequence count");
+        }
+
+        // Output grows as it is decoded, so a corrupt size cannot force a large allocation up front
+        size_t start = out.size();
+        uint64_t pos = 0;
+        BitReader reader(data + offset, size - offset);
+        for (uint64_t i = 0; i < sequenceCount; i++) {
+            // Once the block is complete only the final, empty sequence may follow
+            if (pos == originalSize && i + 1 != sequenceCount) {
+                throw runtime_error("Invalid encoding - sequence past end of block");
+            }
+            uint32_t literalLength = literalLengths.readValue(reader, bitsLeft);
+            if (literalLength > originalSize - pos) {
+                throw runtime_error("Invalid encoding - sequence past end of block");
+            }
+            for (uint64_t end = pos + literalLength; pos < end;) {
+                reader.refill();
+                for (int j = 0; j < HuffmanTable::SYMBOLS_PER_REFILL && pos < end; j++, pos++) {
+                    out += static_cast<char>(literals.readSymbol(reader, bitsLeft));
+                }
+            }
+            if (i + 1 == sequenceCount) {
+                break;
+            }
+
+            uint64_t matchLength = matchLengths.readValue(reader, bitsLeft) + uint64_t(MIN_MATCH);
+            uint64_t distance = distances.readValue(reader, bitsLeft) + uint64_t(1);
+            if (distance > pos || matchLength > originalSize - pos) {
+                throw runtime_error("Invalid encoding - match outside block");
+            }
+            // Overlapping copies repeat the bytes just written, so they go front to back one at a time
+            size_t from = start + pos - distance;
+            if (distance >= matchLength) {
+                out.append(out, from, matchLength);
+            } else {
+                for (uint64_t j = 0; j < matchLength; j++) {
+                    out += out[from + j];
+                }
+            }
+            pos += matchLength;
+        }
+        if (pos != originalSize || bitsLeft != 0) {
+            throw runtime_error("Invalid encoded block - decoded size mismatch");
+        }
+    }
+};
+
+// Block-sorting coding of in-memory blocks, bzip2-style: a Burrows-Wheeler transform groups bytes that
+// share a following context, move-to-front turns those groups into runs of small ranks, runs of rank 0
+// are collapsed into one symbol and a length, and Huffman tables code the result. The suffix array
+// behind the transform is built with SA-IS in linear time, so multi-MiB blocks stay practical.
+//
+// Record layout: the code lengths of the rank table and the run length table, the uint64 original size,
+// CHAINS uint32 chain rows, the uint64 bit length, then the packed bits. A rank of 0 is followed by its
+// run length minus one as a value. Chain row k is the row of the sorted rotations that starts at segment k
+// of the block; row 0 of the first segment is the primary index, which holds the end-of-block marker.
+class BWTCoding {
+    // Largest block; suffix array entries are int32
+    static const uint64_t MAX_BLOCK_SIZE = INT32_MAX - 1;
+    // Segments the inverse transform walks at once, to overlap their cache misses
+    static constexpr int CHAINS = 8;
+
+    // First byte of segment k of a block, for k in [0, CHAINS]
+    static uint64_t segmentStart(uint64_t size, int k) {
+        return size * k / CHAINS;
+    }
+
+    // Sorts the suffixes of text[0..n) into sa by induced sorting (SA-IS, Nong, Zhang and Chan). Symbols
+    // are in [0, alphabetSize) and text[n - 1] must be a unique smallest symbol. LMS substrings are
+    // sorted by induction, named, and sorted recursively when names repeat; the reduced problem reuses
+    // sa's storage.
+    template <typename Symbol>
+    static void buildSuffixArray(const Symbol* text, int32_t* sa, int32_t n, int32_t alphabetSize) {
+        if (n == 1) {
+            sa[0] = 0;
+            return;
+        }
+
+        // S-type suffixes are smaller than the suffix after them; LMS positions start an S run
+        vector<bool> sType(n);
+        sType[n - 1] = true;
+        for (int32_t i = n - 2; i >= 0; i--) {
+            sType[i] = text[i] < text[i + 1] || (text[i] == text[i + 1] && sType[i + 1]);
+        }
+        auto isLMS = [&](int32_t i) { return i > 0 && sType[i] && !sType[i - 1]; };
+
+        vector<int32_t> bucketSizes(alphabetSize, 0), buckets(alphabetSize);
+        for (int32_t i = 0; i < n; i++) {
+            bucketSizes[text[i]]++;
+        }
+        auto bucketHeads = [&]() {
+            int32_t sum = 0;
+            for (int32_t c = 0; c < alphabetSize; c++) {
+                buckets[c] = sum;
+                sum += bucketSizes[c];
+            }
+        };
+        auto bucketTails = [&]() {
+            int32_t sum = 0;
+            for (int32_t c = 0; c < alphabetSize; c++) {
+                sum += bucketSizes[c];
+                buckets[c] = sum;
+            }
+        };
+        // Sorts the L-type suffixes from the LMS suffixes in sa, then the S-type ones from those
+        auto induce = [&]() {
+            bucketHeads();
+            for (int32_t i = 0; i < n; i++) {
+                int32_t j = sa[i] - 1;
+                if (sa[i] > 0 && !sType[j]) {
+                    sa[buckets[text[j]]++] = j;
+                }
+            }
+            bucketTails();
+            for (int32_t i = n - 1; i >= 0; i--) {
+                int32_t j = sa[i] - 1;
+                if (sa[i] > 0 && sType[j]) {
+                    sa[--buckets[text[j]]] = j;
+                }
+            }
+        };
+
+        // Sort the LMS substrings
+        fill(sa, sa + n, -1);
+        bucketTails();
+        for (int32_t i = 1; i < n; i++) {
+            if (isLMS(i)) {
+                sa[--buckets[text[i]]] = i;
+            }
+        }
+        induce();
+
+        // Name them in sorted order, equal substrings getting equal names
+        int32_t lmsCount = 0;
+        for (int32_t i = 0; i < n; i++) {
+            if (isLMS(sa[i])) {
+                sa[lmsCount++] = sa[i];
+            }
+        }
+        fill(sa + lmsCount, sa + n, -1);
+        int32_t names = 0, previous = -1;
+        for (int32_t i = 0; i < lmsCount; i++) {
+            int32_t position = sa[i];
+            bool differs = false;
+            for (int32_t d = 0;; d++) {
+                if (previous < 0 || text[position + d] != text[previous + d] ||
+                    sType[position + d] != sType[previous + d]) {
+                    differs = true;
+                    break;
+                }
+                if (d > 0 && (isLMS(position + d) || isLMS(previous + d))) {
+                    break;
+                }
+            }
+            if (differs) {
+                names++;
+                previous = position;
+            }
+            sa[lmsCount + position / 2] = names - 1;
+        }
+        for (int32_t i = n - 1, j = n - 1; i >= lmsCount; i--) {
+            if (sa[i] >= 0) {
+                sa[j--] = sa[i];
+            }
+        }
+
+        // Sort the LMS suffixes through the string of names
+        int32_t* reduced = sa + n - lmsCount;
+        if (names < lmsCount) {
+            buildSuffixArray(reduced, sa, lmsCount, names);
+        } else {
+            for (int32_t i = 0; i < lmsCount; i++) {
+                sa[reduced[i]] = i;
+            }
+        }
+
+        // Put the sorted LMS suffixes at their bucket tails and induce the rest
+        for (int32_t i = 1, j = 0; i < n; i++) {
+            if (isLMS(i)) {
+                reduced[j++] = i;
+            }
+        }
+        for (int32_t i = 0; i < lmsCount; i++) {
+            sa[i] = reduced[sa[i]];
+        }
+        fill(sa + lmsCount, sa + n, -1);
+        bucketTails();
+        for (int32_t i = lmsCount - 1; i >= 0; i--) {
+            int32_t j = sa[i];
+            sa[i] = -1;
+            sa[--buckets[text[j]]] = j;
+        }
+        induce();
+    }
+
+    // Burrows-Wheeler transform of data: the byte before each suffix, in suffix order. The end-of-block
+    // marker that precedes the whole block is left out; the rows where the segments start stand in for it.
+    static void transform(const unsigned char* data, size_t size, vector<unsigned char>& bwt,
+                          uint32_t chainRows[CHAINS]) {
+        // Shift bytes up by one so that 0 can be the unique smallest end marker
+        vector<uint16_t> text(size + 1);
+        for (size_t i = 0; i < size; i++) {
+            text[i] = data[i] + 1;
+        }
+        text[size] = 0;
+        vector<int32_t> sa(size + 1);
+        buildSuffixArray(text.data(), sa.data(), static_cast<int32_t>(size + 1), 257);
+
+        bwt.resize(size);
+        size_t out = 0;
+        for (size_t row = 0; row <= size; row++) {
+            // The first segment that could start here, then any empty ones after it
+            uint64_t position = sa[row];
+            int k = size > 0 ? static_cast<int>((position * CHAINS + size - 1) / size) : 0;
+            for (; k < CHAINS && segmentStart(size, k) == position; k++) {
+                chainRows[k] = static_cast<uint32_t>(row);
+            }
+            if (position > 0) {
+                bwt[out++] = data[position - 1];
+            }
+        }
+    }
+
+    // Inverts transform: follows the last-to-first mapping back to front through each segment, from the
+    // row of the next segment (the marker's row 0 for the last). Each row's entry packs the row it maps to
+    // above its last byte, so a step costs one random access, and the segments are walked together.
+    template <typename Entry>
+    static void inverseTransform(const unsigned char* bwt, size_t size, const uint32_t chainRows[CHAINS],
+                                 char* out) {
+        uint64_t primary = chainRows[0];
+        // Rows of the sorted rotations start with the marker (row 0), then bytes in order
+        uint64_t starts[256];
+        uint64_t counts[256] = {0};
+        for (size_t i = 0; i < size; i++) {
+            counts[bwt[i]]++;
+        }
+        uint64_t sum = 1;
+        for (int c = 0; c < 256; c++) {
+            starts[c] = sum;
+            sum += counts[c];
+        }
+
+        vector<Entry> entries(size + 1);
+        for (size_t row = 0, i = 0; row <= size; row++) {
+            if (row != primary) {
+                unsigned char byte = bwt[i++];
+                entries[row] = static_cast<Entry>(starts[byte]++ << 8 | byte);
+            }
+        }
+
+        uint64_t rows[CHAINS], begin[CHAINS], next[CHAINS];
+        uint64_t longest = 0;
+        for (int k = 0; k < CHAINS; k++) {
+            rows[k] = k + 1 < CHAINS ? chainRows[k + 1] : 0;
+            begin[k] = segmentStart(size, k);
+            next[k] = segmentStart(size, k + 1);
+            longest = max(longest, next[k] - begin[k]);
+        }
+        // Only the first byte of the block leads to the marker's row; corrupt data can get there early
+        for (uint64_t step = 0; step < longest; step++) {
+            for (int k = 0; k < CHAINS; k++) {
+                if (next[k] > begin[k]) {
+                    if (rows[k] == primary) {
+                        throw runtime_error("Invalid encoded block - bad chain row");
+                    }
+                    Entry entry = entries[rows[k]];
+                    out[--next[k]] = static_cast<char>(entry & 0xFF);
+                    rows[k] = entry >> 8;
+                }
+            }
+        }
+        // Each walk must end where the segment starts
+        for (int k = 0; k < CHAINS; k++) {
+            if (rows[k] != chainRows[k]) {
+                throw runtime_error("Invalid encoded block - bad chain row");
+            }
+        }
+    }
+
+public:
+    // Compresses one in-memory block into a self-contained record; see the class comment for the layout
+    void compressBlock(const char* data, size_t size, vector<unsigned char>& record) {
+        if (size > MAX_BLOCK_SIZE) {
+            throw runtime_error("Block too large for BWT coding");
+        }
+        vector<unsigned char> ranks;
+        uint32_t chainRows[CHAINS];
+        transform(reinterpret_cast<const unsigned char*>(data), size, ranks, chainRows);
+
+        // Move-to-front, in place
+        unsigned char order[256];
+        for (int i = 0; i < 256; i++) {
+            order[i] = static_cast<unsigned char>(i);
+        }
+        for (unsigned char& byte : ranks) {
+            unsigned char rank = 0;
+            while (order[rank] != byte) {
+                rank++;
+            }
+            memmove(order + 1, order, rank);
+            order[0] = byte;
+            byte = rank;
+        }
+
+        // Count ranks and zero-run lengths, then code them
+        uint64_t rankFrequencies[256] = {0}, runFrequencies[256] = {0};
+        int extraBits;
+        uint32_t extra;
+        for (size_t i = 0; i < ranks.size();) {
+            rankFrequencies[ranks[i]]++;
+            size_t run = 1;
+            if (ranks[i] == 0) {
+                while (i + run < ranks.size() && ranks[i + run] == 0 && run < UINT32_MAX) {
+                    run++;
+                }
+                runFrequencies[HuffmanTable::valueCode(static_cast<uint32_t>(run - 1), extraBits, extra)]++;
+            }
+            i += run;
+        }
+        HuffmanTable rankTable, runTable;
+        rankTable.build(rankFrequencies);
+        runTable.build(runFrequencies);
+
+        ostringstream header(ios::binary);
+        rankTable.writeLengths(header);
+        runTable.writeLengths(header);
+        writeBinary(header, static_cast<uint64_t>(size));
+        for (uint32_t row : chainRows) {
+            writeBinary(header, row);
+        }
+        string headerBytes = header.str();
+        size_t bitLengthOffset = headerBytes.size();
+        record.assign(headerBytes.begin(), headerBytes.end());
+        record.resize(bitLengthOffset + sizeof(uint64_t));
+
+        BitWriter writer(record);
+        for (size_t i = 0; i < ranks.size();) {
+            writer.write(rankTable.code(ranks[i]), rankTable.length(ranks[i]));
+            size_t run = 1;
+            if (ranks[i] == 0) {
+                while (i + run < ranks.size() && ranks[i + run] == 0 && run < UINT32_MAX) {
+                    run++;
+                }
+                runTable.writeValue(writer, static_cast<uint32_t>(run - 1));
+            }
+            i += run;
+        }
+        writer.finish();
+        uint64_t bitLength = writer.bitCount();
+        memcpy(record.data() + bitLengthOffset, &bitLength, sizeof(bitLength));
+    }
+
+    // Decompresses a record produced by compressBlock, appending the original bytes to out. A record whose
+    // stored size is not expectedSize is rejected before anything is decoded.
+    void decompressBlock(const unsigned char* data, size_t size, uint64_t expectedSize, string& out) {
+        MemoryBuffer buffer(data, size);
+        istream in(&buffer);
+        HuffmanTable rankTable, runTable;
+        rankTable.readLengths(in);
+        runTable.readLengths(in);
+        uint64_t originalSize = 0, bitsLeft = 0;
+        uint32_t chainRows[CHAINS] = {0};
+        readBinary(in, originalSize);
+        for (uint32_t& row : chainRows) {
+            readBinary(in, row);
+        }
+        readBinary(in, bitsLeft);
+        if (!in) {
+            throw runtime_error("Invalid encoded block - truncated header");
+        }
+        if (originalSize != expectedSize) {
+            throw runtime_error("Invalid encoded block - size mismatch");
+        }
+        size_t offset = buffer.consumed();
+        if (!bitsFitInBytes(bitsLeft, size - offset) || originalSize > MAX_BLOCK_SIZE) {
+            throw runtime_error("Invalid encoded block - truncated data");
+        }
+        for (uint32_t row : chainRows) {
+            if (row > originalSize) {
+                throw runtime_error("Invalid encoded block - bad chain row");
+            }
+        }
+
+        // Undo the run-length and Huffman coding, then move-to-front
+        vector<unsigned char> bwt;
+        bwt.reserve(min<uint64_t>(originalSize, bitsLeft));
+        unsigned char order[256];
+        for (int i = 0; i < 256; i++) {
+            order[i] = static_cast<unsigned char>(i);
+        }
+        BitReader reader(data + offset, size - offset);
+        while (bwt.size() < originalSize) {
+            reader.refill();
+            unsigned char rank = rankTable.readSymbol(reader, bitsLeft);
+            unsigned char byte = order[rank];
+            uint64_t run = 1;
+            if (rank == 0) {
+                run += runTable.readValue(reader, bitsLeft);
+                if (run > originalSize - bwt.size()) {
+                    throw runtime_error("Invalid encoding - run past end of block");
+                }
+            } else {
+                memmove(order + 1, order, rank);
+                order[0] = byte;
+            }
+            bwt.insert(bwt.end(), run, byte);
+        }
+        if (bitsLeft != 0) {
+            throw runtime_error("Invalid encoded block - decoded size mismatch");
+        }
+
+        size_t start = out.size();
+        out.resize(start + originalSize);
+        // Blocks up to 16 MiB fit a row and a byte in 32 bits
+        if (originalSize < (1u << 24)) {
+            inverseTransform<uint32_t>(bwt.data(), bwt.size(), chainRows, &out[start]);
+        } else {
+            inverseTransform<uint64_t>(bwt.data(), bwt.size(), chainRows, &out[start]);
+        }
+    }
+};
+
+// Coders a block container can compress its blocks with; the choice is stored in the container header
+enum class TextCodec : unsigned char {
+    Huffman = 0,        // HuffmanCoding, one order-0 table per block
+    ContextHuffman = 1, // ContextHuffmanCoding, order-1 tables per block
+    TANS = 2,           // TANSCoding, one order-0 tANS table per block
+    LZ77 = 3,           // LZ77Coding, matches plus Huffman-coded literals, lengths and distances
+    BWT = 4             // BWTCoding, Burrows-Wheeler transform, move-to-front and zero runs, then Huffman
+};
+
+// The C API passes codecs as COMPRESSOR_CODEC_* values
+static_assert(static_cast<int>(TextCodec::Huffman) == COMPRESSOR_CODEC_HUFFMAN &&
+                  static_cast<int>(TextCodec::ContextHuffman) == COMPRESSOR_CODEC_ORDER1 &&
+                  static_cast<int>(TextCodec::TANS) == COMPRESSOR_CODEC_TANS &&
+                  static_cast<int>(TextCodec::LZ77) == COMPRESSOR_CODEC_LZ77 &&
+                  static_cast<int>(TextCodec::BWT) == COMPRESSOR_CODEC_BWT,
+              "TextCodec values must match compressor_api.h");
+
+// Parses a --codec name; returns false for an unknown name
+bool parseTextCodec(const string& name, TextCodec& codec) {
+    if (name == "huffman") {
+        codec = TextCodec::Huffman;
+    } else if (name == "order1") {
+        codec = TextCodec::ContextHuffman;
+    } else if (name == "tans") {
+        codec = TextCodec::TANS;
+    } else if (name == "lz77") {
+        codec = TextCodec::LZ77;
+    } else if (name == "bwt") {
+        codec = TextCodec::BWT;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Block container for text compression: the input is split into independent blocks, each with its own
+// code table, which are compressed concurrently on a thread pool and written back in input order.
+// A block index at the end of the file lets blocks be decoded in parallel or individually.
+//
+// Layout: "HFBK", version byte, codec byte (TextCodec), uint32 block size, the block records back to back,
+// the index (one BlockIndexEntry per block), then a footer of uint64 index offset, uint64 block count, "HFBK".
+class BlockContainerCoding {
+    static const unsigned char VERSION = 4;
+
+    // Where one block lives in the compressed file and in the original data
+    struct BlockIndexEntry {
+        uint64_t compressedOffset;   // Offset of the block record in the compressed file
+        uint64_t compressedSize;     // Size of the block record
+        uint64_t uncompressedOffset; // Offset of the block's first byte in the original data
+        uint64_t uncompressedSize;   // Number of original bytes in the block
+    };
+
+    static const size_t HEADER_SIZE = 4 + 1 + 1 + 4;
+    static const size_t FOOTER_SIZE = 8 + 8 + 4;
+
+    ThreadPool pool; // Workers compressing or decompressing blocks
+    size_t blockSize; // Number of input bytes per block
+    TextCodec codec;  // Coder used for the blocks written by encodeToFile
+    PhaseTimer timer; // Phase times of the last call, as seen by the calling thread
+
+    // Compresses one block into a record with the given coder
+    static void compressBlock(TextCodec codec, const char* data, size_t size, vector<unsigned char>& record) {
+        switch (codec) {
+        case TextCodec::Huffman:
+            HuffmanCoding().compressBlock(data, size, record);
+            break;
+        case TextCodec::ContextHuffman:
+            ContextHuffmanCoding().compressBlock(data, size, record);
+            break;
+        case TextCodec::TANS:
+            TANSCoding().compressBlock(data, size, record);
+            break;
+        case TextCodec::LZ77:
+            LZ77Coding().compressBlock(data, size, record);
+            break;
+        case TextCodec::BWT:
+            BWTCoding().compressBlock(data, size, record);
+            break;
+        }
+    }
+
+    // Decompresses a record written by compressBlock with the same coder, appending to out. Coders that
+    // store the block size check it against expectedSize up front, the others stop decoding once it is
+    // reached; the caller checks the rest afterwards.
+    static void decompressBlock(TextCodec codec, const unsigned char* data, size_t size, uint64_t expectedSize,
+                                string& out) {
+        if (expectedSize > MAX_BLOCK_SIZE) {
+            throw runtime_error("Invalid block container - block too large");
+        }
+        switch (codec) {
+        case TextCodec::Huffman:
+            HuffmanCoding().decompressBlock(data, size, expectedSize, out);
+            break;
+        case TextCodec::ContextHuffman:
+            ContextHuffmanCoding().decompressBlock(data, size, expectedSize, out);
+            break;
+        case TextCodec::TANS:
+            TANSCoding().decompressBlock(data, size, expectedSize, out);
+            break;
+        case TextCodec::LZ77:
+            LZ77Coding().decompressBlock(data, size, expectedSize, out);
+            break;
+        case TextCodec::BWT:
+            BWTCoding().decompressBlock(data, size, expectedSize, out);
+            break;
+        }
+    }
+
+    // Reads and validates the header, footer and block index of a mapped container, and the codec
+    // its blocks were written with
+    vector<BlockIndexEntry> readIndex(const MappedFile& input, TextCodec& blockCodec) {
+        const unsigned char* data = input.data();
+        uint64_t fileSize = input.size();
+        if (fileSize < HEADER_SIZE + FOOTER_SIZE || !equal(data, data + 4, MAGIC)) {
+            throw runtime_error("Not a block container file");
+        }
+        if (data[4] != VERSION) {
+            throw runtime_error("Unsupported block container version");
+        }
+        if (data[5] > static_cast<unsigned char>(TextCodec::BWT)) {
+            throw runtime_error("Unsupported block container codec");
+        }
+        blockCodec = static_cast<TextCodec>(data[5]);
+        uint32_t storedBlockSize = 0;
+        memcpy(&storedBlockSize, data + 6, sizeof(storedBlockSize));
+        if (storedBlockSize == 0 || storedBlockSize > MAX_BLOCK_SIZE) {
+            throw runtime_error("Invalid block container - bad block size");
+        }
+
+        uint64_t indexOffset = 0, blockCount = 0;
+        const unsigned char* footer = data + fileSize - FOOTER_SIZE;
+        memcpy(&indexOffset, footer, sizeof(indexOffset));
+        memcpy(&blockCount, footer + 8, sizeof(blockCount));
+        if (!equal(footer + 16, footer + 20, MAGIC) || indexOffset < HEADER_SIZE ||
+            indexOffset > fileSize - FOOTER_SIZE) {
+            throw runtime_error("Invalid block container - corrupt index");
+        }
+        uint64_t indexSize = fileSize - FOOTER_SIZE - indexOffset;
+        if (indexSize % sizeof(BlockIndexEntry) != 0 || blockCount != indexSize / sizeof(BlockIndexEntry)) {
+            throw runtime_error("Invalid block container - corrupt index");
+        }
+
+        vector<BlockIndexEntry> index(blockCount);
+        if (blockCount > 0) {
+            memcpy(index.data(), data + indexOffset, indexSize);
+        }
+
+        uint64_t expectedOffset = 0;
+        for (const BlockIndexEntry& entry : index) {
+            if (entry.uncompressedOffset != expectedOffset || entry.uncompressedSize == 0 ||
+                entry.uncompressedSize > storedBlockSize || entry.compressedOffset < HEADER_SIZE ||
+                entry.compressedOffset > indexOffset || entry.compressedSize > indexOffset - entry.compressedOffset) {
+                throw runtime_error("Invalid block container - corrupt index entry");
+            }
+            expectedOffset += entry.uncompressedSize;
+        }
+        return index;
+    }
+
+    // Decodes index entries [first, last) on the pool straight from the mapped records and writes their
+    // bytes to out in order, dropping skip bytes from the front and stopping after length bytes
+    void decodeBlocks(MappedFile& input, const vector<BlockIndexEntry>& index, TextCodec blockCodec,
+                      size_t first, size_t last, uint64_t skip, uint64_t length, ostream& out) {
+        deque<future<string>> pending;
+        size_t maxPending = pool.size() * 2;
+        size_t written = first;
+
+        auto writeNext = [&]() {
+            PhaseTimer::TimePoint phaseStart = PhaseTimer::now();
+            future<string> next = move(pending.front());
+            pending.pop_front();
+            string decoded = next.get();
+            timer.lap("decode", phaseStart);
+            input.releaseBefore(index[written].compressedOffset + index[written].compressedSize);
+            written++;
+            uint64_t start = min<uint64_t>(skip, decoded.size());
+            uint64_t count = min<uint64_t>(decoded.size() - start, length);
+            out.write(decoded.data() + start, count);
+            skip -= start;
+            length -= count;
+            timer.lap("write", phaseStart);
+        };
+
+        // Tasks read their records from the mapping, so none may outlive a failure that unmaps it
+        try {
+            for (size_t i = first; i < last; i++) {
+                const unsigned char* record = input.data() + index[i].compressedOffset;
+                uint64_t recordSize = index[i].compressedSize;
+                uint64_t expectedSize = index[i].uncompressedSize;
+
+                // A one-thread pool decodes the block inside submit, so that time counts as decoding too
+                PhaseTimer::TimePoint submitStart = PhaseTimer::now();
+                pending.push_back(pool.submit([blockCodec, record, recordSize, expectedSize] {
+                    string decoded;
+                    decoded.reserve(expectedSize);
+                    decompressBlock(blockCodec, record, recordSize, expectedSize, decoded);
+                    if (decoded.size() != expectedSize) {
+                        throw runtime_error("Invalid block container - block size mismatch");
+                    }
+                    return decoded;
+                }));
+                timer.lap("decode", submitStart);
+
+                if (pending.size() >= maxPending) {
+                    writeNext();
+                }
+            }
+
+            while (!pending.empty()) {
+                writeNext();
+            }
+        } catch (...) {
+            for (future<string>& task : pending) {
+                task.wait();
+            }
+            throw;
+        }
+    }
+
+public:
+    // Block size used when none is given on the command line
+    static const size_t DEFAULT_BLOCK_SIZE = 1 << 20;
+
+    // Largest supported block; bounds the per-block buffers held in flight
+    static const size_t MAX_BLOCK_SIZE = 16 << 20;
+
+    // Magic bytes identifying a block container file
+    static constexpr char MAGIC[4] = {'H', 'F', 'B', 'K'};
+
+    // threadCount 0 sizes the pool to the machine; codec only affects compression, since decoding
+    // takes the codec from the container
+    BlockContainerCoding(size_t threadCount, size_t blockSize, TextCodec codec = TextCodec::Huffman)
+        : pool(threadCount), blockSize(blockSize), codec(codec) {
+        if (blockSize == 0 || blockSize > MAX_BLOCK_SIZE) {
+            throw runtime_error("Block size must be between 1 and " + to_string(MAX_BLOCK_SIZE) + " bytes");
+        }
+    }
+
+    // Number of worker threads in the pool
+    size_t threadCount() const {
+        return pool.size();
+    }
+
+    // Returns true if the file starts with the block container magic
+    static bool isBlockFile(const string& path) {
+        ifstream inFile(path, ios::binary);
+        char magic[4];
+        return inFile.read(magic, sizeof(magic)) && equal(magic, magic + 4, MAGIC);
+    }
+
+    // Compresses the memory-mapped input file block by block; workers read their block straight from
+    // the mapping. At most two blocks per worker are in flight, so memory stays bounded while every
+    // worker has the next block ready.
+    void encodeToFile(const string& inputFile, const string& encodedFile) {
+        timer.clear();
+        PhaseTimer::TimePoint start = PhaseTimer::now();
+        MappedFile input(inputFile);
+        OutputFile output(encodedFile);
+        ostream& outFile = output.out();
+        timer.lap("read", start);
+
+        outFile.write(MAGIC, sizeof(MAGIC));
+        outFile.put(VERSION);
+        outFile.put(static_cast<char>(codec));
+        writeBinary(outFile, static_cast<uint32_t>(blockSize));
+
+        vector<BlockIndexEntry> index;
+        uint64_t compressedOffset = HEADER_SIZE;
+        uint64_t uncompressedOffset = 0;
+        deque<pair<uint64_t, future<vector<unsigned char>>>> pending;
+        size_t maxPending = pool.size() * 2;
+
+        auto writeNext = [&]() {
+            PhaseTimer::TimePoint phaseStart = PhaseTimer::now();
+            uint64_t originalSize = pending.front().first;
+            future<vector<unsigned char>> next = move(pending.front().second);
+            pending.pop_front();
+            vector<unsigned char> record = next.get();
+            timer.lap("compress", phaseStart);
+
+            outFile.write(reinterpret_cast<const char*>(record.data()), record.size());
+            index.push_back(BlockIndexEntry{compressedOffset, record.size(), uncompressedOffset, originalSize});
+            compressedOffset += record.size();
+            uncompressedOffset += originalSize;
+            input.releaseBefore(uncompressedOffset);
+            timer.lap("write", phaseStart);
+        };
+
+        // Tasks read their blocks from the mapping, so none may outlive a failure that unmaps it
+        try {
+            for (uint64_t offset = 0; offset < input.size(); offset += blockSize) {
+                const char* block = reinterpret_cast<const char*>(input.data() + offset);
+                size_t bytesRead = min<uint64_t>(blockSize, input.size() - offset);
+
+                TextCodec blockCodec = codec;
+                // A one-thread pool compresses the block inside submit, so that time counts as compressing too
+                PhaseTimer::TimePoint submitStart = PhaseTimer::now();
+                pending.emplace_back(bytesRead, pool.submit([blockCodec, block, bytesRead] {
+                    vector<unsigned char> record;
+                    compressBlock(blockCodec, block, bytesRead, record);
+                    return record;
+                }));
+                timer.lap("compress", submitStart);
+
+                if (pending.size() >= maxPending) {
+                    writeNext();
+                }
+            }
+
+            while (!pending.empty()) {
+                writeNext();
+            }
+        } catch (...) {
+            for (auto& task : pending) {
+                task.second.wait();
+            }
+            throw;
+        }
+
+        start = PhaseTimer::now();
+        outFile.write(reinterpret_cast<const char*>(index.data()), index.size() * sizeof(BlockIndexEntry));
+        writeBinary(outFile, compressedOffset);
+        writeBinary(outFile, static_cast<uint64_t>(index.size()));
+        outFile.write(MAGIC, sizeof(MAGIC));
+        output.close();
+        timer.lap("write", start);
+    }
+
+    // Decompresses a block container back into the original file, decoding blocks in parallel
+    void decodeFromFile(const string& encodedFile, const string& outputFile) {
+        timer.clear();
+        PhaseTimer::TimePoint start = PhaseTimer::now();
+        MappedFile input(encodedFile);
+        TextCodec blockCodec;
+        vector<BlockIndexEntry> index = readIndex(input, blockCodec);
+        timer.lap("read", start);
+
+        OutputFile output(outputFile);
+        decodeBlocks(input, index, blockCodec, 0, index.size(), 0, UINT64_MAX, output.out());
+        start = PhaseTimer::now();
+        output.close();
+        timer.lap("write", start);
+    }
+
+    // Wall time per phase of the last encodeToFile or decodeFromFile. Block work overlaps across
+    // workers, so "compress"/"decode" is the time the calling thread spent handing blocks to the pool and
+    // waiting for finished ones; with one thread the blocks are coded on the calling thread and all of it
+    // shows up there.
+    const PhaseTimer& phaseTimes() const {
+        return timer;
+    }
+
+    // Writes bytes [offset, offset + length) of the original data to outputFile, decoding only the
+    // blocks that overlap the range. A negative offset counts back from the end of the data.
+    void extractRange(const string& encodedFile, int64_t offset, uint64_t length, const string& outputFile) {
+        MappedFile input(encodedFile);
+        TextCodec blockCodec;
+        vector<BlockIndexEntry> index = readIndex(input, blockCodec);
+
+        uint64_t totalSize = index.empty() ? 0 : index.back().uncompressedOffset + index.back().uncompressedSize;
+        uint64_t start = offset < 0 ? totalSize - min<uint64_t>(totalSize, -static_cast<uint64_t>(offset))
+                                    : min<uint64_t>(offset, totalSize);
+        length = min(length, totalSize - start);
+
+        auto firstBlock = upper_bound(index.begin(), index.end(), start,
+            [](uint64_t value, const BlockIndexEntry& entry) { return value < entry.uncompressedOffset; });
+        size_t first = firstBlock == index.begin() ? 0 : (firstBlock - index.begin()) - 1;
+        auto lastBlock = lower_bound(index.begin(), index.end(), start + length,
+            [](const BlockIndexEntry& entry, uint64_t value) { return entry.uncompressedOffset < value; });
+        size_t last = length == 0 ? first : lastBlock - index.begin();
+
+        OutputFile output(outputFile);
+        if (first < last) {
+            decodeBlocks(input, index, blockCodec, first, last, start - index[first].uncompressedOffset, length,
+                         output.out());
+        }
+        output.close();
+
+        cout << "Extracted " << length << " bytes from offset " << start << " (" << (last - first)
+             << " of " << index.size() << " blocks decoded)" << endl;
+    }
+};
+
+// Looks up a trailing "--name=value" command line option; returns true and stores value if present
+bool findOption(int argc, char* argv[], int firstOption, const string& name, string& value) {
+    string prefix = "--" + name;
+    for (int i = firstOption; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == prefix) {
+            value = "";
+            return true;
+        }
+        if (arg.compare(0, prefix.size() + 1, prefix + "=") == 0) {
+            value = arg.substr(prefix.size() + 1);
+            return true;
+        }
+    }
+    return false;
+}
+// Long-lived libjpeg decompressor/compressor pair with a reusable strip buffer. Creating the structs once
+// and reusing them across images avoids per-image setup and allocation; libjpeg errors are turned into
+// exceptions instead of exiting the process, so one bad image does not take down a batch.
+class JPEGCodecContext {
+    // Scanlines decoded and re-encoded per step of the streaming pipeline
+    static constexpr JDIMENSION STRIP_ROWS = 16;
+
+    // libjpeg error manager that jumps back to the running operation with the formatted message
+    struct ErrorManager {
+        jpeg_error_mgr pub;
+        jmp_buf jump;
+        char message[JMSG_LENGTH_MAX];
+    };
+
+    ErrorManager error;                  // Shared by both structs
+    std::vector<unsigned char> strip;    // Pixel rows of the current strip (or whole image), kept between images
+    std::vector<JSAMPROW> rowPointers;   // Row pointers into strip
+
+    // libjpeg will not switch a struct between source or destination manager types, so the context keeps
+    // one manager of each type and swaps the right one in before use
+    jpeg_source_mgr* stdioSource;            // Manager created by jpeg_stdio_src, when not installed
+    jpeg_source_mgr* memorySource;           // Manager created by jpeg_mem_src, when not installed
+    bool memorySourceActive;                 // Which of the two decompressor.src currently is
+    jpeg_destination_mgr* stdioDestination;  // Manager created by jpeg_stdio_dest, when not installed
+    jpeg_destination_mgr* memoryDestination; // Manager created by jpeg_mem_dest, when not installed
+    bool memoryDestinationActive;            // Which of the two compressor.dest currently is
+    unsigned char* memoryBuffer;             // Output of the last in-memory encode (malloc'd by libjpeg)
+    unsigned long memorySize;                // Size of memoryBuffer
+    PhaseTimer timer;                        // Phase times of the last operation
+
+    // Optimized Huffman coding rewrites the compressor's tables in place, and jpeg_set_defaults keeps
+    // existing tables, so optimize() saves the standard tables first and puts them back afterwards
+    JHUFF_TBL savedHuffmanTables[2][NUM_HUFF_TBLS]; // DC and AC tables
+    bool huffmanTablesSaved;
+
+    static void errorExit(j_common_ptr cinfo) {
+        ErrorManager* manager = reinterpret_cast<ErrorManager*>(cinfo->err);
+        (*cinfo->err->format_message)(cinfo, manager->message);
+        longjmp(manager->jump, 1);
+    }
+
+    // Returns both structs to their idle state after a failed operation and reports the error
+    [[noreturn]] void fail() {
+        jpeg_abort_decompress(&decompressor);
+        jpeg_abort_compress(&compressor);
+        releaseMemoryBuffer();
+        restoreHuffmanTables();
+        throw std::runtime_error(std::string("JPEG error: ") + error.message);
+    }
+
+    // Copies the compressor's current Huffman tables aside before they get overwritten
+    void saveHuffmanTables() {
+        for (int table = 0; table < NUM_HUFF_TBLS; table++) {
+            if (compressor.dc_huff_tbl_ptrs[table]) {
+                savedHuffmanTables[0][table] = *compressor.dc_huff_tbl_ptrs[table];
+            }
+            if (compressor.ac_huff_tbl_ptrs[table]) {
+                savedHuffmanTables[1][table] = *compressor.ac_huff_tbl_ptrs[table];
+            }
+        }
+        huffmanTablesSaved = true;
+    }
+
+    // Undoes saveHuffmanTables
+    void restoreHuffmanTables() {
+        if (!huffmanTablesSaved) {
+            return;
+        }
+        for (int table = 0; table < NUM_HUFF_TBLS; table++) {
+            if (compressor.dc_huff_tbl_ptrs[table]) {
+                *compressor.dc_huff_tbl_ptrs[table] = savedHuffmanTables[0][table];
+            }
+            if (compressor.ac_huff_tbl_ptrs[table]) {
+                *compressor.ac_huff_tbl_ptrs[table] = savedHuffmanTables[1][table];
+            }
+        }
+        huffmanTablesSaved = false;
+    }
+
+    // Frees the buffer filled by the last in-memory encode
+    void releaseMemoryBuffer() {
+        free(memoryBuffer);
+        memoryBuffer = nullptr;
+        memorySize = 0;
+    }
+
+    // Points the decompressor at a FILE
+    void useStdioSource(FILE* infile) {
+        if (memorySourceActive) {
+            memorySource = decompressor.src;
+            decompressor.src = stdioSource;
+            memorySourceActive = false;
+        }
+        jpeg_stdio_src(&decompressor, infile);
+    }
+
+    // Points the decompressor at a memory buffer, which must stay alive until decoding finishes
+    void useMemorySource(const unsigned char* input, size_t inputSize) {
+        if (!memorySourceActive) {
+            stdioSource = decompressor.src;
+            decompressor.src = memorySource;
+            memorySourceActive = true;
+        }
+        jpeg_mem_src(&decompressor, input, inputSize);
+    }
+
+    // Points the compressor at a FILE
+    void useStdioDestination(FILE* outfile) {
+        if (memoryDestinationActive) {
+            memoryDestination = compressor.dest;
+            compressor.dest = stdioDestination;
+            memoryDestinationActive = false;
+        }
+        jpeg_stdio_dest(&compressor, outfile);
+    }
+
+    // Points the compressor at a fresh memory buffer (memoryBuffer/memorySize)
+    void useMemoryDestination() {
+        if (!memoryDestinationActive) {
+            stdioDestination = compressor.dest;
+            compressor.dest = memoryDestination;
+            memoryDestinationActive = true;
+        }
+        releaseMemoryBuffer();
+        jpeg_mem_dest(&compressor, &memoryBuffer, &memorySize);
+    }
+
+    // Copies the result of the last in-memory encode into output and frees libjpeg's buffer
+    void takeMemoryBuffer(std::vector<unsigned char>& output) {
+        output.assign(memoryBuffer, memoryBuffer + memorySize);
+        releaseMemoryBuffer();
+    }
+
+    // Makes sure the strip buffer can hold stripRows rows of rowStride bytes
+    void reserveStrip(size_t rowStride, JDIMENSION stripRows) {
+        if (strip.size() < rowStride * stripRows) {
+            strip.resize(rowStride * stripRows);
+        }
+        rowPointers.resize(stripRows);
+        for (JDIMENSION row = 0; row < stripRows; row++) {
+            rowPointers[row] = strip.data() + row * rowStride;
+        }
+    }
+
+    // Makes the decompressor produce a downscaled image straight out of the IDCT. The scale is 1/scaleDenominator,
+    // reduced further (down to 1/8) until both sides fit in maxDimension when that is non-zero. Only 1/2, 1/4
+    // and 1/8 are used since every libjpeg version supports them; images still too large at 1/8 stay at 1/8.
+    void setDecodeScale(unsigned int scaleDenominator, JDIMENSION maxDimension) {
+        decompressor.scale_num = 1;
+        decompressor.scale_denom = std::max(scaleDenominator, 1u);
+        jpeg_calc_output_dimensions(&decompressor);
+        while (maxDimension > 0 && decompressor.scale_denom < 8 &&
+               std::max(decompressor.output_width, decompressor.output_height) > maxDimension) {
+            decompressor.scale_denom *= 2;
+            jpeg_calc_output_dimensions(&decompressor);
+        }
+    }
+
+    // Sets up the compressor to encode the decompressor's output pixels at the given quality
+    void setPixelParameters(int quality) {
+        compressor.image_width = decompressor.output_width;
+        compressor.image_height = decompressor.output_height;
+        compressor.input_components = decompressor.output_components;
+        compressor.in_color_space = decompressor.out_color_space;
+        jpeg_set_defaults(&compressor);
+        jpeg_set_quality(&compressor, quality, TRUE);
+    }
 
-    // Constructor for initializing the Node with a character and its frequency
-    Node(char ch, int freq) {
-        this->ch = ch;
-        this->freq = freq;
-        left = right = nullptr;
+    // Sets which metadata markers the decompressor keeps in memory
+    void saveMarkers(unsigned int lengthLimit) {
+        jpeg_save_markers(&decompressor, JPEG_COM, lengthLimit);
+        for (int marker = 0; marker < 16; marker++) {
+            jpeg_save_markers(&decompressor, JPEG_APP0 + marker, lengthLimit);
+        }
     }
-};
 
-// MinHeap class for managing priority queue operations for Huffman Tree construction
-class MinHeap {
-    vector<Node*> heap;
+    // Body of recompress(), reading from the installed source and writing to the installed destination
+    void recompressImage(int quality, unsigned int scaleDenominator, JDIMENSION maxDimension) {
+        timer.clear();
+        PhaseTimer::TimePoint start = PhaseTimer::now();
 
-    // Helper function for heapifying upward (maintaining heap property on insert)
-    void heapifyUp(int index) {
-    while (index > 0) {
-        int parentIndex = (index - 1) / 2;
-        if (heap[parentIndex]->freq <= heap[index]->freq) {
-            break;
+        // Read the header; metadata is not carried over, so don't keep it
+        saveMarkers(0);
+        jpeg_read_header(&decompressor, TRUE);
+        setDecodeScale(scaleDenominator, maxDimension);
+        jpeg_start_decompress(&decompressor);
+        timer.lap("decode", start);
+
+        setPixelParameters(quality);
+
+        JDIMENSION stripRows = std::max<JDIMENSION>(STRIP_ROWS, decompressor.rec_outbuf_height);
+        reserveStrip(static_cast<size_t>(decompressor.output_width) * decompressor.output_components, stripRows);
+
+        // Decode each strip and hand it to the compressor immediately
+        jpeg_start_compress(&compressor, TRUE);
+        timer.lap("encode", start);
+        while (decompressor.output_scanline < decompressor.output_height) {
+            JDIMENSION rowsRead = 0;
+            while (rowsRead < stripRows && decompressor.output_scanline < decompressor.output_height) {
+                rowsRead += jpeg_read_scanlines(&decompressor, rowPointers.data() + rowsRead, stripRows - rowsRead);
+            }
+            timer.lap("decode", start);
+            jpeg_write_scanlines(&compressor, rowPointers.data(), rowsRead);
+            timer.lap("encode", start);
         }
-        swap(heap[parentIndex], heap[index]);
-        index = parentIndex;
-    }
-}
 
-void heapifyDown(int index) {
-    int size = heap.size();
-    while (index < size) {
-        int leftChild = 2 * index + 1;
-        int rightChild = 2 * index + 2;
-        int smallest = index;
+        jpeg_finish_compress(&compressor);
+        timer.lap("encode", start);
+        jpeg_finish_decompress(&decompressor);
+        timer.lap("decode", start);
+    }
 
-        if (leftChild < size && heap[leftChild]->freq < heap[smallest]->freq) {
-            smallest = leftChild;
+    // Rewrites the image in input into memoryBuffer. Kept apart from the size check in optimize(), so no
+    // local of that function is live across setjmp.
+    void optimizeInMemory(const unsigned char* input, size_t inputSize, bool progressive) {
+        if (setjmp(error.jump)) {
+            fail();
         }
+        useMemorySource(input, inputSize);
+        useMemoryDestination();
+        optimizeImage(progressive);
+    }
 
-        if (rightChild < size && heap[rightChild]->freq < heap[smallest]->freq) {
-            smallest = rightChild;
+    // Body of optimize(), reading from the installed source and writing to the installed destination
+    void optimizeImage(bool progressive) {
+        timer.clear();
+        PhaseTimer::TimePoint start = PhaseTimer::now();
+
+        // Read the header keeping all metadata markers
+        saveMarkers(0xFFFF);
+        jpeg_read_header(&decompressor, TRUE);
+
+        // Read the quantized DCT coefficients without running the IDCT
+        jvirt_barray_ptr* coefficients = jpeg_read_coefficients(&decompressor);
+        timer.lap("decode", start);
+
+        // Set up the compressor with the source's quantization tables and sampling
+        jpeg_copy_critical_parameters(&decompressor, &compressor);
+        saveHuffmanTables();
+        compressor.optimize_coding = TRUE;
+        if (progressive || decompressor.progressive_mode) {
+            jpeg_simple_progression(&compressor);
         }
 
-        if (smallest == index) {
-            break;
+        // Write the coefficients, then the saved markers (skipping JFIF/Adobe markers libjpeg already wrote)
+        jpeg_write_coefficients(&compressor, coefficients);
+        for (jpeg_saved_marker_ptr marker = decompressor.marker_list; marker; marker = marker->next) {
+            bool isJFIF = marker->marker == JPEG_APP0 && marker->data_length >= 5 &&
+                          memcmp(marker->data, "JFIF", 5) == 0;
+            bool isAdobe = marker->marker == JPEG_APP0 + 14 && marker->data_length >= 5 &&
+                           memcmp(marker->data, "Adobe", 5) == 0;
+            if ((isJFIF && compressor.write_JFIF_header) || (isAdobe && compressor.write_Adobe_marker)) {
+                continue;
+            }
+            jpeg_write_marker(&compressor, marker->marker, marker->data, marker->data_length);
         }
 
-        swap(heap[index], heap[smallest]);
-        index = smallest;
+        jpeg_finish_compress(&compressor);
+        timer.lap("encode", start);
+        jpeg_finish_decompress(&decompressor);
+        timer.lap("decode", start);
+        restoreHuffmanTables();
     }
-}
 
+    // Body of compressToSize(), reading from the installed source
+    int searchQuality(uint64_t maxBytes, std::vector<unsigned char>& output) {
+        timer.clear();
+        PhaseTimer::TimePoint start = PhaseTimer::now();
+
+        // Decode the whole image once
+        saveMarkers(0);
+        jpeg_read_header(&decompressor, TRUE);
+        jpeg_start_decompress(&decompressor);
+        reserveStrip(static_cast<size_t>(decompressor.output_width) * decompressor.output_components,
+                     decompressor.output_height);
+        while (decompressor.output_scanline < decompressor.output_height) {
+            jpeg_read_scanlines(&decompressor, rowPointers.data() + decompressor.output_scanline,
+                                decompressor.output_height - decompressor.output_scanline);
+        }
+        jpeg_finish_decompress(&decompressor);
+        timer.lap("decode", start);
+
+        // Bisect the quality, encoding each candidate into memory
+        int low = 1, high = 100, best = 0;
+        while (low <= high) {
+            int candidate = (low + high) / 2;
+
+            useMemoryDestination();
+            setPixelParameters(candidate);
+            jpeg_start_compress(&compressor, TRUE);
+            jpeg_write_scanlines(&compressor, rowPointers.data(), compressor.image_height);
+            jpeg_finish_compress(&compressor);
+
+            if (memorySize <= maxBytes) {
+                best = candidate;
+                output.assign(memoryBuffer, memoryBuffer + memorySize);
+                low = candidate + 1;
+            } else {
+                high = candidate - 1;
+            }
+        }
+
+        releaseMemoryBuffer();
+        timer.lap("search", start);
+        return best;
+    }
 
 public:
-    // Constructor
-    MinHeap() {}
+    jpeg_decompress_struct decompressor;
+    jpeg_compress_struct compressor;
 
-    // Returns true if the heap is empty
-    bool empty() const {
-        return heap.empty();
+    JPEGCodecContext()
+        : stdioSource(nullptr), memorySource(nullptr), memorySourceActive(false), stdioDestination(nullptr),
+          memoryDestination(nullptr), memoryDestinationActive(false), memoryBuffer(nullptr), memorySize(0),
+          huffmanTablesSaved(false) {
+        decompressor.err = jpeg_std_error(&error.pub);
+        compressor.err = &error.pub;
+        error.pub.error_exit = errorExit;
+        jpeg_create_decompress(&decompressor);
+        jpeg_create_compress(&compressor);
     }
 
-    // Returns the size of the heap
-    int size() const {
-        return heap.size();
+    ~JPEGCodecContext() {
+        releaseMemoryBuffer();
+        jpeg_destroy_compress(&compressor);
+        jpeg_destroy_decompress(&decompressor);
     }
 
-    // Inserts a node into the heap
-    void insert(Node* node) {
-        heap.push_back(node);
-        heapifyUp(heap.size() - 1);
+    JPEGCodecContext(const JPEGCodecContext&) = delete;
+    JPEGCodecContext& operator=(const JPEGCodecContext&) = delete;
+
+    // Wall time per phase ("decode", "encode", "search") of the last operation
+    const PhaseTimer& phaseTimes() const {
+        return timer;
     }
 
-    // Removes and returns the node with the minimum frequency
-    Node* extractMin() {
-        if (heap.empty()) return nullptr;
-        Node* minNode = heap[0];
-        heap[0] = heap.back();
-        heap.pop_back();
-        heapifyDown(0);
-        return minNode;
+    // Recompresses a JPEG at the given quality by streaming strips of scanlines from the decompressor
+    // straight into the compressor, so only STRIP_ROWS rows are ever held in memory. With a
+    // scaleDenominator above 1 or a non-zero maxDimension the image is decoded at reduced size in the
+    // DCT domain (see setDecodeScale), which skips most of the IDCT work, and re-encoded at that size.
+    void recompress(FILE* infile, FILE* outfile, int quality, unsigned int scaleDenominator = 1,
+                    JDIMENSION maxDimension = 0) {
+        if (setjmp(error.jump)) {
+            fail();
+        }
+        useStdioSource(infile);
+        useStdioDestination(outfile);
+        recompressImage(quality, scaleDenominator, maxDimension);
     }
-};
 
-//Function to calculate file size
-long getFileSize(const std::string& filename) {
-    std::ifstream file(filename, std::ios::binary);
-    
-    if (!file) {
-        std::cerr << "Error opening file: " << filename << std::endl;
-        return -1;
+    // Same as above from one memory buffer into another; output is replaced with the encoded image
+    void recompress(const unsigned char* input, size_t inputSize, std::vector<unsigned char>& output, int quality,
+                    unsigned int scaleDenominator = 1, JDIMENSION maxDimension = 0) {
+        if (setjmp(error.jump)) {
+            fail();
+        }
+        useMemorySource(input, inputSize);
+        useMemoryDestination();
+        recompressImage(quality, scaleDenominator, maxDimension);
+        takeMemoryBuffer(output);
     }
-    
-    // Move the file pointer to the end
-    file.seekg(0, std::ios::end);
-    
-    // Get the position of the file pointer (which is the file size)
-    long size = file.tellg();
-    
-    // Close the file
-    file.close();
-    
-    return size;
-}
 
-// Main class for Huffman Coding operations: encoding and decoding files
-class HuffmanCoding {
-    Node* root;                              // Root node of the Huffman Tree
-    unordered_map<char, string> huffmanCodes; // Map for storing the Huffman codes
-    unordered_map<char, int> frequencies;     // Map for storing character frequencies
-    string encodedStr;                        // Encoded string representation of input text
+    // Rewrites a JPEG losslessly in the DCT coefficient domain: the quantized coefficients are copied
+    // as-is and only the entropy coding changes (optimized Huffman tables, optionally progressive scans;
+    // progressive sources are always rewritten as progressive). No pixels are decoded, so this is much
+    // faster than recompress() and loses no quality. APPn and COM markers (EXIF, ICC profiles, comments)
+    // are carried over. The rewritten image is encoded into memory and only written when it is smaller
+    // than the input; otherwise the input is copied to outfile unchanged and false is returned.
+    bool optimize(FILE* infile, FILE* outfile, bool progressive) {
+        if (setjmp(error.jump)) {
+            fail();
+        }
+        useStdioSource(infile);
+        useMemoryDestination();
+        optimizeImage(progressive);
 
-    // Builds a frequency table from the input text
-    void buildFrequencyTable(const string &text) {
-        frequencies.clear();
-        for (char ch : text) {
-            frequencies[ch]++;
+        std::vector<unsigned char> output;
+        takeMemoryBuffer(output);
+        long inputSize = fseek(infile, 0, SEEK_END) == 0 ? ftell(infile) : -1;
+        bool smaller = inputSize < 0 || output.size() < static_cast<uint64_t>(inputSize);
+        if (!smaller) {
+            rewind(infile);
+            output.resize(1 << 16);
+            size_t count;
+            while ((count = fread(output.data(), 1, output.size(), infile)) > 0) {
+                if (fwrite(output.data(), 1, count, outfile) != count) {
+                    throw std::runtime_error("Error writing output file");
+                }
+            }
+        } else if (fwrite(output.data(), 1, output.size(), outfile) != output.size()) {
+            throw std::runtime_error("Error writing output file");
         }
+        return smaller;
     }
 
-    // Builds the Huffman Tree based on character frequencies
-    void buildHuffmanTree() {
-        deleteTree(root); // Clean up previous tree if it exists
-        root = nullptr;
-        huffmanCodes.clear();
+    // Same as above from one memory buffer into another; output is replaced with the rewritten image, or
+    // with a copy of the input when the rewritten image is not smaller (then false is returned)
+    bool optimize(const unsigned char* input, size_t inputSize, std::vector<unsigned char>& output, bool progressive) {
+        optimizeInMemory(input, inputSize, progressive);
+        if (memorySize >= inputSize) {
+            releaseMemoryBuffer();
+            output.assign(input, input + inputSize);
+            return false;
+        }
+        takeMemoryBuffer(output);
+        return true;
+    }
 
-        vector<pair<char, int>> freqVec(frequencies.begin(), frequencies.end());
-        sort(freqVec.begin(), freqVec.end());
+    // Finds the highest quality whose output fits in maxBytes. The image is decoded once into memory and
+    // then re-encoded into memory buffers while bisecting the quality, so the source is never re-read or
+    // re-decoded. On success output holds the encoded image and the chosen quality is returned;
+    // returns 0 if even quality 1 is larger than maxBytes.
+    int compressToSize(FILE* infile, uint64_t maxBytes, std::vector<unsigned char>& output) {
+        if (setjmp(error.jump)) {
+            fail();
+        }
+        useStdioSource(infile);
+        return searchQuality(maxBytes, output);
+    }
 
-        // Initialize the min-heap with nodes for each character and frequency
-        MinHeap minHeap;
-        for (const auto& pair : freqVec) {
-            minHeap.insert(new Node(pair.first, pair.second));
+    // Same as above reading the source image from memory
+    int compressToSize(const unsigned char* input, size_t inputSize, uint64_t maxBytes,
+                       std::vector<unsigned char>& output) {
+        if (setjmp(error.jump)) {
+            fail();
         }
+        useMemorySource(input, inputSize);
+        return searchQuality(maxBytes, output);
+    }
+};
+
+class JPEGCompressor {
+public:
+    JPEGCompressor(const std::string& inputFile, const std::string& outputFile, int quality)
+        : inputFile(inputFile), outputFile(outputFile), quality(quality), scaleDenominator(1), maxDimension(0) {}
 
-        // Build the tree by extracting two nodes with minimum frequency and combining them
-        while (minHeap.size() > 1) {
-            Node *left = minHeap.extractMin();
-            Node *right = minHeap.extractMin();
+    // For the lossless modes, which keep the source quantization and ignore quality
+    JPEGCompressor(const std::string& inputFile, const std::string& outputFile)
+        : JPEGCompressor(inputFile, outputFile, 75) {}
 
-            Node *newNode = new Node('\0', left->freq + right->freq);
-            newNode->left = left;
-            newNode->right = right;
-            minHeap.insert(newNode);
-        }
+    // Recompresses the image at the configured quality, streaming scanline strips
+    void compress() {
+        JPEGCodecContext context;
+        compress(context);
+    }
+
+    // Same as compress(), reusing the libjpeg structs and buffers of an existing context
+    void compress(JPEGCodecContext& context) {
+        withFiles([&](FILE* infile, FILE* outfile) {
+            context.recompress(infile, outfile, quality, scaleDenominator, maxDimension);
+        });
+        phases = context.phaseTimes();
+    }
 
-        root = minHeap.empty() ? nullptr : minHeap.extractMin();
-        buildHuffmanCodes(root, ""); // Generate codes for each character
+    // Makes compress() decode at 1/scaleDenominator size (2, 4 or 8), shrinking further until the longer
+    // side is at most maxDimension pixels when that is non-zero
+    void setDownscale(unsigned int scaleDenominator, JDIMENSION maxDimension) {
+        this->scaleDenominator = scaleDenominator;
+        this->maxDimension = maxDimension;
     }
 
-    // Recursively deletes the Huffman Tree to release memory
-    void deleteTree(Node* node) {
-        if (node == nullptr) return;
-        deleteTree(node->left);
-        deleteTree(node->right);
-        delete node;
+    // Rewrites the file losslessly in the DCT coefficient domain; see JPEGCodecContext::optimize.
+    // Returns false if the rewrite was not smaller and the input was copied instead.
+    bool optimize(bool progressive) {
+        JPEGCodecContext context;
+        return optimize(context, progressive);
     }
 
-    // Recursively builds Huffman codes for each character by traversing the tree
-    void buildHuffmanCodes(Node* node, string str) {
-        if (!node) return;
+    // Same as optimize(), reusing the libjpeg structs of an existing context
+    bool optimize(JPEGCodecContext& context, bool progressive) {
+        bool smaller = false;
+        withFiles([&](FILE* infile, FILE* outfile) { smaller = context.optimize(infile, outfile, progressive); });
+        phases = context.phaseTimes();
+        return smaller;
+    }
 
-        if (!node->left && !node->right) {
-            huffmanCodes[node->ch] = str;
+    // Writes the image at the highest quality whose output fits in maxBytes and returns that quality;
+    // see JPEGCodecContext::compressToSize
+    int compressToSize(uint64_t maxBytes) {
+        JPEGCodecContext context;
+        std::vector<unsigned char> encoded;
+        FILE* infile = fopen(inputFile.c_str(), "rb");
+        if (!infile) {
+            throw std::runtime_error("Can't open input file: " + inputFile);
+        }
+        int chosenQuality = 0;
+        try {
+            chosenQuality = context.compressToSize(infile, maxBytes, encoded);
+        } catch (...) {
+            fclose(infile);
+            throw;
+        }
+        fclose(infile);
+        // The output is only created once a quality fits, so a failed search leaves no empty file behind
+        if (chosenQuality == 0) {
+            throw std::runtime_error("No quality setting fits in " + std::to_string(maxBytes) + " bytes");
         }
 
-        buildHuffmanCodes(node->left, str + "0");
-        buildHuffmanCodes(node->right, str + "1");
+        FILE* outfile = fopen(outputFile.c_str(), "wb");
+        if (!outfile) {
+            throw std::runtime_error("Can't open output file: " + outputFile);
+        }
+        bool written = fwrite(encoded.data(), 1, encoded.size(), outfile) == encoded.size();
+        written = fclose(outfile) == 0 && written;
+        if (!written) {
+            throw std::runtime_error("Error writing output file: " + outputFile);
+        }
+        phases = context.phaseTimes();
+        return chosenQuality;
     }
 
-    // Encodes the given text into a binary string using Huffman codes
-    string getEncodedString(const string &text) {
-        string encodedStr = "";
-        for (char ch : text) {
-            if (huffmanCodes.find(ch) != huffmanCodes.end()) {
-                encodedStr += huffmanCodes[ch];
-            }
+    // Phase times of the last successful operation; see JPEGCodecContext::phaseTimes
+    const PhaseTimer& phaseTimes() const {
+        return phases;
+    }
+
+private:
+    std::string inputFile;
+    std::string outputFile;
+    int quality;
+    unsigned int scaleDenominator; // Decode scale for compress(), 1 for full size
+    JDIMENSION maxDimension;       // Longest side allowed by compress(), 0 for no limit
+    PhaseTimer phases;             // Copied from the context after each operation
+
+    // Opens the input and output files, runs the operation and closes them again, also on error
+    template <typename Operation>
+    void withFiles(Operation operation) {
+        FILE* infile = fopen(inputFile.c_str(), "rb");
+        if (!infile) {
+            throw std::runtime_error("Can't open input file: " + inputFile);
+        }
+        FILE* outfile = fopen(outputFile.c_str(), "wb");
+        if (!outfile) {
+            fclose(infile);
+            throw std::runtime_error("Can't open output file: " + outputFile);
+        }
+
+        try {
+            operation(infile, outfile);
+        } catch (...) {
+            fclose(outfile);
+            fclose(infile);
+            throw;
+        }
+
+        bool written = fclose(outfile) == 0;
+        fclose(infile);
+        if (!written) {
+            throw std::runtime_error("Error writing output file: " + outputFile);
         }
-        return encodedStr;
     }
+};
 
-    // Decodes the encoded binary string back into the original text
-    string decodeString(Node* node, const string &encodedStr) {
-        string decodedStr = "";
-        Node* current = node;
-        
-        for (char bit : encodedStr) {
-            if (!current) {
-                throw runtime_error("Invalid tree state during decoding");
-            }
+// Compresses every JPEG in a directory into another directory on a pool of workers. Each worker owns
+// one JPEGCodecContext for its whole run, so libjpeg structs and strip buffers are reused across images.
+class JPEGBatchCompressor {
+    std::string inputDir;
+    std::string outputDir;
+    int quality;
+    size_t threadCount;
+    unsigned int scaleDenominator; // Passed on to JPEGCompressor::setDownscale
+    JDIMENSION maxDimension;
+
+    // Returns true for .jpg/.jpeg files, ignoring case
+    static bool isJPEGFile(const std::filesystem::path& path) {
+        std::string extension = path.extension().string();
+        transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+        return extension == ".jpg" || extension == ".jpeg";
+    }
 
-            current = (bit == '0') ? current->left : current->right;
+public:
+    // threadCount 0 sizes the pool to the machine
+    JPEGBatchCompressor(const std::string& inputDir, const std::string& outputDir, int quality, size_t threadCount)
+        : inputDir(inputDir), outputDir(outputDir), quality(quality), threadCount(threadCount),
+          scaleDenominator(1), maxDimension(0) {}
+
+    // Downscales every image while decoding; see JPEGCompressor::setDownscale
+    void setDownscale(unsigned int scaleDenominator, JDIMENSION maxDimension) {
+        this->scaleDenominator = scaleDenominator;
+        this->maxDimension = maxDimension;
+    }
 
-            if (current && !current->left && !current->right) {
-                decodedStr += current->ch;
-                current = node;
+    // Compresses all images and prints aggregate throughput; returns the number of images that failed
+    size_t run() {
+        std::vector<std::filesystem::path> files;
+        for (const auto& entry : std::filesystem::directory_iterator(inputDir)) {
+            if (entry.is_regular_file() && isJPEGFile(entry.path())) {
+                files.push_back(entry.path());
             }
         }
+        sort(files.begin(), files.end());
+        std::filesystem::create_directories(outputDir);
 
-        if (current != node) {
-            throw runtime_error("Invalid encoding - incomplete sequence");
+        ThreadPool pool(threadCount);
+        std::atomic<size_t> nextFile(0);
+        std::atomic<uint64_t> bytesIn(0), bytesOut(0);
+        std::mutex errorMutex;
+        std::vector<std::string> errors;
+        auto start = std::chrono::steady_clock::now();
+
+        std::vector<std::future<void>> workers;
+        for (size_t worker = 0; worker < pool.size(); worker++) {
+            workers.push_back(pool.submit([&] {
+                JPEGCodecContext context;
+                for (size_t i = nextFile++; i < files.size(); i = nextFile++) {
+                    std::string input = files[i].string();
+                    std::string output = (std::filesystem::path(outputDir) / files[i].filename()).string();
+                    try {
+                        JPEGCompressor compressor(input, output, quality);
+                        compressor.setDownscale(scaleDenominator, maxDimension);
+                        compressor.compress(context);
+                        bytesIn += getFileSize(input);
+                        bytesOut += getFileSize(output);
+                    } catch (const std::exception& e) {
+                        std::error_code ignored;
+                        std::filesystem::remove(output, ignored);
+                        std::lock_guard<std::mutex> lock(errorMutex);
+                        errors.push_back(input + ": " + e.what());
+                    }
+                }
+            }));
+        }
+        for (auto& worker : workers) {
+            worker.get();
         }
-        
-        return decodedStr;
-    }
 
-    // Saves the encoded binary string to a file along with the frequency table for decoding
-    void saveEncodedToFile(const string& encodedStr, const string& encodedFile) {
-        ofstream outFile(encodedFile, ios::binary);
-        if (!outFile) {
-            throw runtime_error("Cannot open output file");
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        size_t compressed = files.size() - errors.size();
+        for (const std::string& message : errors) {
+            cerr << "Failed: " << message << endl;
         }
+        cout << "Compressed " << compressed << " of " << files.size() << " images on " << pool.size()
+             << " threads in " << seconds << " s" << endl;
+        cout << "original size:" << bytesIn << " bytes" << endl;
+        cout << "compressed size:" << bytesOut << " bytes" << endl;
+        if (seconds > 0) {
+            cout << "Throughput: " << compressed / seconds << " images/s, "
+                 << bytesIn / seconds / (1 << 20) << " MB/s" << endl;
+        }
+        return errors.size();
+    }
+};
+
+// C interface declared in compressor_api.h. Exceptions are turned into a -1 return and a per-thread
+// error message at this boundary; JPEG calls share one JPEGCodecContext per calling thread.
+namespace {
 
-        int freqSize = frequencies.size();
-        outFile.write(reinterpret_cast<const char*>(&freqSize), sizeof(freqSize));
-        
-        vector<pair<char, int>> freqVec(frequencies.begin(), frequencies.end());
-        sort(freqVec.begin(), freqVec.end());
-        
-        for (const auto& pair : freqVec) {
-            outFile.put(pair.first);
-            outFile.write(reinterpret_cast<const char*>(&pair.second), sizeof(pair.second));
+thread_local std::string apiError;
+
+// Runs one API operation, timing it and filling stats (if given) from the byte counts it reports
+template <typename Operation>
+int runApiCall(compressor_stats* stats, Operation operation) {
+    try {
+        compressor_stats result = {0, 0, 0.0};
+        auto start = std::chrono::steady_clock::now();
+        operation(result);
+        result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (stats) {
+            *stats = result;
         }
+        apiError.clear();
+        return 0;
+    } catch (const std::exception& e) {
+        apiError = e.what();
+    } catch (...) {
+        apiError = "Unknown error";
+    }
+    return -1;
+}
+
+// Hands a result over to the caller in a malloc'd buffer, to be freed with compressor_free
+template <typename Container>
+void exportBuffer(const Container& data, unsigned char** output, size_t* outputSize) {
+    if (!output || !outputSize) {
+        throw std::invalid_argument("Output buffer pointers must not be NULL");
+    }
+    unsigned char* buffer = static_cast<unsigned char*>(malloc(std::max<size_t>(data.size(), 1)));
+    if (!buffer) {
+        throw std::bad_alloc();
+    }
+    memcpy(buffer, data.data(), data.size());
+    *output = buffer;
+    *outputSize = data.size();
+}
+
+JPEGCodecContext& threadJPEGContext() {
+    thread_local JPEGCodecContext context;
+    return context;
+}
 
-        int encodedLength = encodedStr.length();
-        outFile.write(reinterpret_cast<const char*>(&encodedLength), sizeof(encodedLength));
+} // namespace
 
-        unsigned char buffer = 0;
-        int bitCount = 0;
-        for (char bit : encodedStr) {
-            buffer = (buffer << 1) | (bit == '1');
-            bitCount++;
-            if (bitCount == 8) {
-                outFile.put(buffer);
-                buffer = 0;
-                bitCount = 0;
-            }
+extern "C" {
+
+COMPRESSOR_API int compressor_api_version(void) {
+    return COMPRESSOR_API_VERSION;
+}
+
+COMPRESSOR_API const char* compressor_last_error(void) {
+    return apiError.c_str();
+}
+
+COMPRESSOR_API void compressor_free(void* buffer) {
+    free(buffer);
+}
+
+COMPRESSOR_API int compressor_text_compress_file(const char* input_path, const char* output_path,
+                                                 size_t block_size, unsigned int threads, int codec,
+                                                 compressor_stats* stats) {
+    return runApiCall(stats, [&](compressor_stats& result) {
+        if (codec < COMPRESSOR_CODEC_HUFFMAN || codec > COMPRESSOR_CODEC_BWT) {
+            throw std::invalid_argument("Unknown text codec " + std::to_string(codec));
+        }
+        if (codec != COMPRESSOR_CODEC_HUFFMAN && block_size == 0) {
+            throw std::invalid_argument("Text codecs other than Huffman need a block size");
+        }
+        if (block_size > 0) {
+            BlockContainerCoding(threads, block_size, static_cast<TextCodec>(codec)).encodeToFile(input_path, output_path);
+        } else {
+            HuffmanCoding().encodeToFile(input_path, output_path);
         }
+        result.input_bytes = getFileSize(input_path);
+        result.output_bytes = getFileSize(output_path);
+    });
+}
 
-        if (bitCount > 0) {
-            buffer <<= (8 - bitCount);
-            outFile.put(buffer);
+COMPRESSOR_API int compressor_text_decompress_file(const char* input_path, const char* output_path,
+                                                   unsigned int threads, compressor_stats* stats) {
+    return runApiCall(stats, [&](compressor_stats& result) {
+        if (BlockContainerCoding::isBlockFile(input_path)) {
+            BlockContainerCoding(threads, BlockContainerCoding::MAX_BLOCK_SIZE).decodeFromFile(input_path, output_path);
+        } else {
+            HuffmanCoding().decodeFromFile(input_path, output_path);
         }
+        result.input_bytes = getFileSize(input_path);
+        result.output_bytes = getFileSize(output_path);
+    });
+}
+
+COMPRESSOR_API int compressor_text_compress_buffer(const void* input, size_t input_size, unsigned char** output,
+                                                   size_t* output_size, compressor_stats* stats) {
+    return runApiCall(stats, [&](compressor_stats& result) {
+        vector<unsigned char> encoded;
+        HuffmanCoding().encodeToBuffer(static_cast<const char*>(input), input_size, encoded);
+        exportBuffer(encoded, output, output_size);
+        result.input_bytes = input_size;
+        result.output_bytes = encoded.size();
+    });
+}
 
-        outFile.close();
-    } 
+COMPRESSOR_API int compressor_text_decompress_buffer(const void* input, size_t input_size, unsigned char** output,
+                                                     size_t* output_size, compressor_stats* stats) {
+    return runApiCall(stats, [&](compressor_stats& result) {
+        string decoded;
+        HuffmanCoding().decodeFromBuffer(static_cast<const unsigned char*>(input), input_size, decoded);
+        exportBuffer(decoded, output, output_size);
+        result.input_bytes = input_size;
+        result.output_bytes = decoded.size();
+    });
+}
 
-    // Loads encoded data from file and rebuilds the Huffman Tree for decoding
-    void loadEncodedFromFile(const string& encodedFile) {
-        ifstream inFile(encodedFile, ios::binary);
-        if (!inFile) {
-            throw runtime_error("Cannot open input file");
+COMPRESSOR_API int compressor_codebook_train(const char* sample_path, const char* codebook_path,
+                                             uint32_t* codebook_id) {
+    return runApiCall(nullptr, [&](compressor_stats&) {
+        HuffmanCodebook codebook = HuffmanCodebook::train(HuffmanCodebook::samplesAt(sample_path));
+        codebook.save(codebook_path);
+        if (codebook_id) {
+            *codebook_id = codebook.id();
         }
+    });
+}
 
-        int freqSize;
-        inFile.read(reinterpret_cast<char*>(&freqSize), sizeof(freqSize));
-        
-        frequencies.clear();
-        for (int i = 0; i < freqSize; i++) {
-            char ch;
-            int freq;
-            inFile.get(ch);
-            inFile.read(reinterpret_cast<char*>(&freq), sizeof(freq));
-            frequencies[ch] = freq;
+COMPRESSOR_API int compressor_codebook_load(const char* path, uint32_t* codebook_id) {
+    return runApiCall(nullptr, [&](compressor_stats&) {
+        uint32_t id = CodebookRegistry::instance().open(path)->id();
+        if (codebook_id) {
+            *codebook_id = id;
         }
+    });
+}
+
+COMPRESSOR_API int compressor_text_compress_codebook_buffer(uint32_t codebook_id, const void* input, size_t input_size,
+                                                            unsigned char** output, size_t* output_size,
+                                                            compressor_stats* stats) {
+    return runApiCall(stats, [&](compressor_stats& result) {
+        vector<unsigned char> encoded;
+        CodebookRegistry::instance().find(codebook_id)->compress(static_cast<const char*>(input), input_size, encoded);
+        exportBuffer(encoded, output, output_size);
+        result.input_bytes = input_size;
+        result.output_bytes = encoded.size();
+    });
+}
+
+COMPRESSOR_API int compressor_text_decompress_codebook_buffer(const void* input, size_t input_size,
+                                                              unsigned char** output, size_t* output_size,
+                                                              compressor_stats* stats) {
+    return runApiCall(stats, [&](compressor_stats& result) {
+        const unsigned char* data = static_cast<const unsigned char*>(input);
+        string decoded;
+        uint32_t id = HuffmanCodebook::recordId(data, input_size);
+        CodebookRegistry::instance().find(id)->decompress(data, input_size, decoded);
+        exportBuffer(decoded, output, output_size);
+        result.input_bytes = input_size;
+        result.output_bytes = decoded.size();
+    });
+}
+
+COMPRESSOR_API int compressor_jpeg_compress_file(const char* input_path, const char* output_path, int quality,
+                                                 compressor_stats* stats) {
+    return runApiCall(stats, [&](compressor_stats& result) {
+        JPEGCompressor(input_path, output_path, quality).compress(threadJPEGContext());
+        result.input_bytes = getFileSize(input_path);
+        result.output_bytes = getFileSize(output_path);
+    });
+}
+
+COMPRESSOR_API int compressor_jpeg_compress_buffer(const void* input, size_t input_size, int quality,
+                                                   unsigned char** output, size_t* output_size,
+                                                   compressor_stats* stats) {
+    return runApiCall(stats, [&](compressor_stats& result) {
+        std::vector<unsigned char> encoded;
+        threadJPEGContext().recompress(static_cast<const unsigned char*>(input), input_size, encoded, quality);
+        exportBuffer(encoded, output, output_size);
+        result.input_bytes = input_size;
+        result.output_bytes = encoded.size();
+    });
+}
+
+COMPRESSOR_API int compressor_jpeg_optimize_file(const char* input_path, const char* output_path, int progressive,
+                                                 compressor_stats* stats) {
+    return runApiCall(stats, [&](compressor_stats& result) {
+        JPEGCompressor(input_path, output_path).optimize(threadJPEGContext(), progressive != 0);
+        result.input_bytes = getFileSize(input_path);
+        result.output_bytes = getFileSize(output_path);
+    });
+}
+
+COMPRESSOR_API int compressor_jpeg_optimize_buffer(const void* input, size_t input_size, int progressive,
+                                                   unsigned char** output, size_t* output_size,
+                                                   compressor_stats* stats) {
+    return runApiCall(stats, [&](compressor_stats& result) {
+        std::vector<unsigned char> encoded;
+        threadJPEGContext().optimize(static_cast<const unsigned char*>(input), input_size, encoded, progressive != 0);
+        exportBuffer(encoded, output, output_size);
+        result.input_bytes = input_size;
+        result.output_bytes = encoded.size();
+    });
+}
+
+} // extern "C"
+
+#ifndef COMPRESSOR_LIBRARY
 
-        int encodedLength;
-        inFile.read(reinterpret_cast<char*>(&encodedLength), sizeof(encodedLength));
+#ifndef _WIN32
+// Long-running compression service on a Unix domain socket, so callers with many small jobs skip process
+// startup and libjpeg setup. Each connection sends jobs as lines of tab-separated fields:
+//   text <compress|decompress> <input> <output>
+//   jpeg compress <input> <output> <quality>
+//   jpeg optimize <input> <output> [progressive]
+// and gets one line back per job, in order: "ok <input bytes> <output bytes> <seconds>" or
+// "error <message>", also tab-separated. Jobs run on one shared pool, whose workers keep their codec
+// state warm between jobs; a connection's jobs run one at a time, so clients wanting parallelism open
+// several connections. An idle connection holds no worker.
+class CompressionServer {
+    // One client: bytes received but not yet run as jobs, and whether one of its jobs is on the pool
+    struct Connection {
+        std::string pending;
+        bool busy = false;
+    };
 
-        encodedStr = "";
-        unsigned char buffer;
-        int bitsRead = 0;
-        while (inFile.get(reinterpret_cast<char&>(buffer)) && bitsRead < encodedLength) {
-            for (int i = 7; i >= 0 && bitsRead < encodedLength; i--) {
-                encodedStr += ((buffer >> i) & 1) ? '1' : '0';
-                bitsRead++;
+    // Most clients connected at once; further clients wait in the listen backlog until one disconnects
+    static const size_t MAX_CONNECTIONS = 256;
+
+    std::string socketPath;
+    ThreadPool pool;                     // Workers running jobs
+    int wakePipe[2];                     // Workers write (fd, sent) here when a connection's job is done
+    std::map<int, Connection> clients;   // Open connections by socket; only touched by run()
+
+    // Runs one job line and returns its reply line (without the newline)
+    static std::string runJob(const std::string& line) {
+        std::vector<std::string> fields;
+        std::stringstream stream(line);
+        for (std::string field; getline(stream, field, '\t');) {
+            fields.push_back(field);
+        }
+
+        // Jobs already run on a pool worker, so each one stays on that thread (a one-thread ThreadPool runs
+        // its tasks inline) rather than starting a machine-sized pool of its own
+        compressor_stats stats;
+        int status = -1;
+        try {
+            if (fields.size() == 4 && fields[0] == "text" && fields[1] == "compress") {
+                status = compressor_text_compress_file(fields[2].c_str(), fields[3].c_str(), 0, 1,
+                                                       COMPRESSOR_CODEC_HUFFMAN, &stats);
+            } else if (fields.size() == 4 && fields[0] == "text" && fields[1] == "decompress") {
+                status = compressor_text_decompress_file(fields[2].c_str(), fields[3].c_str(), 1, &stats);
+            } else if (fields.size() == 5 && fields[0] == "jpeg" && fields[1] == "compress") {
+                status = compressor_jpeg_compress_file(fields[2].c_str(), fields[3].c_str(), stoi(fields[4]), &stats);
+            } else if ((fields.size() == 4 || fields.size() == 5) && fields[0] == "jpeg" && fields[1] == "optimize") {
+                bool progressive = fields.size() == 5 && fields[4] == "progressive";
+                status = compressor_jpeg_optimize_file(fields[2].c_str(), fields[3].c_str(), progressive, &stats);
+            } else {
+                return "error\tUnknown job: " + line;
             }
+        } catch (const std::exception&) {
+            return "error\tInvalid job: " + line;
         }
 
-        inFile.close();
-        buildHuffmanTree();
+        if (status != 0) {
+            return std::string("error\t") + compressor_last_error();
+        }
+        return "ok\t" + std::to_string(stats.input_bytes) + "\t" + std::to_string(stats.output_bytes) + "\t" +
+               std::to_string(stats.seconds);
     }
 
-public:
-    // Constructor initializes the HuffmanCoding object
-    HuffmanCoding() : root(nullptr) {}
-    
-    // Destructor to release memory by deleting the Huffman Tree
-    ~HuffmanCoding() {
-        deleteTree(root);
-    }
-    
-    // Encodes input file text and saves encoded output to a file
-    void encodeToFile(const string& inputFile, const string& encodedFile) {
-        ifstream inFile(inputFile);
-        if (!inFile) {
-            throw runtime_error("Cannot open input file");
+    // Writes all of data to the socket; returns false if the client went away
+    static bool sendAll(int fd, const std::string& data) {
+        for (size_t sent = 0; sent < data.size();) {
+            ssize_t written = write(fd, data.data() + sent, data.size() - sent);
+            if (written < 0 && errno == EINTR) {
+                continue;
+            }
+            if (written <= 0) {
+                return false;
+            }
+            sent += written;
         }
+        return true;
+    }
 
-        string text((istreambuf_iterator<char>(inFile)), istreambuf_iterator<char>());
-        inFile.close();
-
-        buildFrequencyTable(text);
-        buildHuffmanTree();
-        string encodedStr = getEncodedString(text);
-        saveEncodedToFile(encodedStr, encodedFile);
-        
-        cout << "File successfully compressed" << endl;
-        long inputsize = getFileSize(inputFile);
-        long outputsize = getFileSize(encodedFile);
-        cout<<"original file size:"<<inputsize<<" bytes"<<endl;
-        cout<<"compressed file size:"<<outputsize<<" bytes"<<endl;
-        double compressionPercentage = (static_cast<double>(outputsize) / inputsize) * 100;
-        cout << "Compression Percentage: " << compressionPercentage << "%" << endl;
+    // Takes the next non-empty job line out of pending; returns false if no complete line is buffered
+    static bool nextLine(std::string& pending, std::string& line) {
+        size_t newline;
+        while ((newline = pending.find('\n')) != std::string::npos) {
+            line = pending.substr(0, newline);
+            pending.erase(0, newline + 1);
+            if (!line.empty() && line.back() == '\r') {
+                line.pop_back();
+            }
+            if (!line.empty()) {
+                return true;
+            }
+        }
+        return false;
+    }
 
+    // Submits the client's next buffered job to the pool unless one is already running. With at most one
+    // job per connection in flight, replies go back in the order the jobs were sent.
+    void dispatch(int fd, Connection& client) {
+        std::string line;
+        if (client.busy || !nextLine(client.pending, line)) {
+            return;
+        }
+        client.busy = true;
+        int wakeFd = wakePipe[1];
+        pool.submit([fd, line, wakeFd] {
+            int done[2] = {fd, sendAll(fd, runJob(line) + "\n") ? 1 : 0};
+            // Writes of up to PIPE_BUF bytes are atomic, so messages from several workers never interleave
+            while (write(wakeFd, done, sizeof(done)) < 0 && errno == EINTR) {
+            }
+        });
     }
 
-    // Decodes the encoded file back into its original text and saves it to a file
-    void decodeFromFile(const string& encodedFile, const string& outputFile) {
-        loadEncodedFromFile(encodedFile);
-        string decodedStr = decodeString(root, encodedStr);
+    // Closes a client and forgets it
+    void disconnect(int fd) {
+        close(fd);
+        clients.erase(fd);
+    }
 
-        ofstream outFile(outputFile);
-        if (!outFile) {
-            throw runtime_error("Cannot open output file");
+    // Handles the (fd, sent) messages of finished jobs: frees their connections for the next job
+    void finishJobs() {
+        int done[64][2];
+        ssize_t received = read(wakePipe[0], done, sizeof(done));
+        for (ssize_t i = 0; i < received / static_cast<ssize_t>(sizeof(done[0])); i++) {
+            int fd = done[i][0];
+            Connection& client = clients[fd];
+            client.busy = false;
+            if (!done[i][1]) {
+                disconnect(fd);
+            } else {
+                dispatch(fd, client);
+            }
         }
-        outFile << decodedStr;
-        outFile.close();
-        
-        cout << "File successfully decompressed" << endl;
     }
-};
-class JPEGCompressor {
-public:
-    JPEGCompressor(const std::string& inputFile, const std::string& outputFile, int quality)
-        : inputFile(inputFile), outputFile(outputFile), quality(quality) {}
 
-    void compress() {
-        // Open the input file
-        FILE* infile = fopen(inputFile.c_str(), "rb");
-        if (!infile) {
-            throw std::runtime_error("Can't open input file: " + inputFile);
+    // Reads what a client sent and queues its jobs; disconnects it on end of input
+    void receive(int fd) {
+        char buffer[4096];
+        ssize_t received = read(fd, buffer, sizeof(buffer));
+        if (received < 0 && errno == EINTR) {
+            return;
         }
+        if (received <= 0) {
+            disconnect(fd);
+            return;
+        }
+        Connection& client = clients[fd];
+        client.pending.append(buffer, received);
+        dispatch(fd, client);
+    }
 
-        // Create and initialize the JPEG decompressor
-        jpeg_decompress_struct cinfo;
-        jpeg_error_mgr jerr;
-        cinfo.err = jpeg_std_error(&jerr);
-        jpeg_create_decompress(&cinfo);
+public:
+    // threadCount 0 sizes the worker pool to the machine
+    CompressionServer(const std::string& socketPath, size_t threadCount)
+        : socketPath(socketPath), pool(threadCount) {
+        if (pipe(wakePipe) != 0) {
+            throw std::runtime_error("Can't create server pipe");
+        }
+    }
 
-        // Specify the data source for decompression
-        jpeg_stdio_src(&cinfo, infile);
-        jpeg_read_header(&cinfo, TRUE);
-        jpeg_start_decompress(&cinfo);
+    // Number of worker threads running jobs
+    size_t threadCount() const {
+        return pool.size();
+    }
 
-        // Allocate memory for the image
-        std::vector<unsigned char> buffer(cinfo.output_width * cinfo.output_height * cinfo.output_components);
-        while (cinfo.output_scanline < cinfo.output_height) {
-            unsigned char* row_pointer = buffer.data() + cinfo.output_scanline * cinfo.output_width * cinfo.output_components;
-            jpeg_read_scanlines(&cinfo, &row_pointer, 1);
+    // Binds the socket (replacing a stale one left by a previous run) and serves clients forever. One
+    // thread waits on all connections with poll() and hands each complete job line to the pool, so a
+    // worker is only busy while a job runs and idle clients hold none.
+    void run() {
+        sockaddr_un address = {};
+        address.sun_family = AF_UNIX;
+        if (socketPath.size() >= sizeof(address.sun_path)) {
+            throw std::runtime_error("Socket path too long: " + socketPath);
         }
+        memcpy(address.sun_path, socketPath.c_str(), socketPath.size() + 1);
 
-        // Clean up the decompressor
-        jpeg_finish_decompress(&cinfo);
-        fclose(infile);
-
-        // Create and initialize the JPEG compressor
-        jpeg_compress_struct cinfo_out;
-        jpeg_error_mgr jerr_out;
-        cinfo_out.err = jpeg_std_error(&jerr_out);
-        jpeg_create_compress(&cinfo_out);
+        // Only a socket is replaced; anything else at the path is left alone
+        struct stat existing;
+        if (lstat(socketPath.c_str(), &existing) == 0) {
+            if (!S_ISSOCK(existing.st_mode)) {
+                throw std::runtime_error("Path exists and is not a socket: " + socketPath);
+            }
+            unlink(socketPath.c_str());
+        }
 
-        // Open the output file
-        FILE* outfile = fopen(outputFile.c_str(), "wb");
-        if (!outfile) {
-            throw std::runtime_error("Can't open output file: " + outputFile);
+        int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listener < 0) {
+            throw std::runtime_error("Can't create socket");
+        }
+        if (bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+            listen(listener, SOMAXCONN) != 0) {
+            close(listener);
+            throw std::runtime_error("Can't listen on socket: " + socketPath);
         }
-        jpeg_stdio_dest(&cinfo_out, outfile);
 
-        // Set compression parameters
-        cinfo_out.image_width = cinfo.output_width;
-        cinfo_out.image_height = cinfo.output_height;
-        cinfo_out.input_components = cinfo.output_components;
-        cinfo_out.in_color_space = cinfo.out_color_space;
+        // A client that disconnects before reading its reply must not kill the server
+        signal(SIGPIPE, SIG_IGN);
 
-        jpeg_set_defaults(&cinfo_out);
-        jpeg_set_quality(&cinfo_out, quality, TRUE);
+        std::vector<pollfd> watched;
+        while (true) {
+            // Busy connections are not read until their job is done, which keeps their replies in order
+            watched.assign({pollfd{wakePipe[0], POLLIN, 0}});
+            if (clients.size() < MAX_CONNECTIONS) {
+                watched.push_back(pollfd{listener, POLLIN, 0});
+            }
+            for (const auto& client : clients) {
+                if (!client.second.busy) {
+                    watched.push_back(pollfd{client.first, POLLIN, 0});
+                }
+            }
+            if (poll(watched.data(), watched.size(), -1) < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                close(listener);
+                throw std::runtime_error("Error waiting for clients on " + socketPath);
+            }
 
-        // Start compression
-        jpeg_start_compress(&cinfo_out, TRUE);
-        while (cinfo_out.next_scanline < cinfo_out.image_height) {
-            unsigned char* row_pointer = buffer.data() + cinfo_out.next_scanline * cinfo_out.image_width * cinfo_out.input_components;
-            jpeg_write_scanlines(&cinfo_out, &row_pointer, 1);
+            for (const pollfd& entry : watched) {
+                if (!entry.revents) {
+                    continue;
+                }
+                if (entry.fd == wakePipe[0]) {
+                    finishJobs();
+                } else if (entry.fd == listener) {
+                    int client = accept(listener, nullptr, nullptr);
+                    if (client >= 0) {
+                        clients[client];
+                    } else if (errno != EINTR && errno != ECONNABORTED) {
+                        close(listener);
+                        throw std::runtime_error("Error accepting connection on " + socketPath);
+                    }
+                } else if (clients.count(entry.fd) && !clients[entry.fd].busy) {
+                    receive(entry.fd);
+                }
+            }
         }
-
-        // Finish compression
-        jpeg_finish_compress(&cinfo_out);
-        fclose(outfile);
-
-        // Clean up
-        jpeg_destroy_compress(&cinfo_out);
     }
-
-private:
-    std::string inputFile;
-    std::string outputFile;
-    int quality;
 };
+#endif
+
+// Reads the optional --scale=1/N and --max-dim=N options of the JPEG recompression modes; returns false
+// if the scale is not one of 1, 1/2, 1/4 or 1/8
+bool findDownscaleOptions(int argc, char* argv[], int firstOption, unsigned int& scaleDenominator,
+                          JDIMENSION& maxDimension) {
+    string value;
+    scaleDenominator = 1;
+    if (findOption(argc, argv, firstOption, "scale", value)) {
+        if (value == "1/2" || value == "1/4" || value == "1/8") {
+            scaleDenominator = stoul(value.substr(2));
+        } else if (value != "1") {
+            return false;
+        }
+    }
+    maxDimension = findOption(argc, argv, firstOption, "max-dim", value) ? stoul(value) : 0;
+    return true;
+}
 
 int main(int argc, char* argv[]) {
+    if (argc >= 3 && string(argv[1]) == "serve") {
+#ifdef _WIN32
+        cerr << "serve needs Unix domain sockets and is not available on Windows" << endl;
+        return 1;
+#else
+        string threads;
+        findOption(argc, argv, 3, "threads", threads);
+        CompressionServer server(argv[2], threads.empty() ? 0 : stoul(threads));
+        cout << "Serving on " << argv[2] << " with " << server.threadCount() << " worker threads" << endl;
+        server.run();
+        return 0;
+#endif
+    }
+
     if (argc < 5) {
-        cerr << "Usage: compressor.exe text <compress/decompress> <input_file> <output_file>" << endl;
+        cerr << "Usage: compressor.exe text <compress/decompress> <input_file> <output_file> [--threads=N] [--block-size=BYTES] [--codec=NAME] [--stats=json]" << endl;
+        cerr << "       compressor.exe text extract <input_file> <output_file> <offset> [length] [--threads=N]" << endl;
+        cerr << "       compressor.exe text train <sample_file_or_dir> <codebook_file> [--header=FILE]" << endl;
+        cerr << "       compressor.exe text <compress/decompress> <input_file> <output_file> --codebook=<FILE|builtin> [--stats=json]" << endl;
+        cerr << "       compressor.exe jpeg compress <input_file> <output_file> <quality> [--scale=1/N] [--max-dim=N] [--stats=json]" << endl;
+        cerr << "       compressor.exe jpeg optimize <input_file> <output_file> [--progressive] [--stats=json]" << endl;
+        cerr << "       compressor.exe jpeg batch <input_dir> <output_dir> <quality> [--threads=N] [--scale=1/N] [--max-dim=N]" << endl;
+        cerr << "       compressor.exe jpeg target <input_file> <output_file> <max_bytes> [--stats=json]" << endl;
+        cerr << "       compressor.exe serve <socket_path> [--threads=N]" << endl;
         return 1;
     }
 
@@ -426,36 +4395,163 @@ int main(int argc, char* argv[]) {
     string inputFile = argv[3];
     string outputFile = argv[4];
 
+    // --stats=json replaces the progress lines with one JSON object describing the operation
+    string statsFormat;
+    bool jsonStats = findOption(argc, argv, 5, "stats", statsFormat);
+    if (jsonStats && statsFormat != "json") {
+        cerr << "--stats only supports json" << endl;
+        return 1;
+    }
+    if (jsonStats && (operation == "extract" || operation == "batch" || operation == "train")) {
+        cerr << "--stats is not supported for " << operation << endl;
+        return 1;
+    }
+    ostream silent(nullptr);
+    ostream& messages = jsonStats ? silent : cout;
+    PhaseTimer phases;
+    PhaseTimer::TimePoint started = PhaseTimer::now();
+
     if (fileType == "text") {
+        string threads, blockSize, codecName;
+        bool useBlocks = findOption(argc, argv, 5, "threads", threads) | findOption(argc, argv, 5, "block-size", blockSize) |
+                         findOption(argc, argv, 5, "codec", codecName);
+        TextCodec codec = TextCodec::Huffman;
+        if (!codecName.empty() && !parseTextCodec(codecName, codec)) {
+            cerr << "--codec must be huffman, order1, tans, lz77 or bwt" << endl;
+            return 1;
+        }
+        string codebookName;
+        bool useCodebook = findOption(argc, argv, 5, "codebook", codebookName);
+        if (useCodebook && useBlocks) {
+            cerr << "--codebook can't be combined with --threads, --block-size or --codec" << endl;
+            return 1;
+        }
+
         if (operation == "compress") {
-            HuffmanCoding huffman;
-            huffman.encodeToFile(inputFile, outputFile);
-            cout << "Text file compression completed successfully!" << endl;
+            if (useCodebook) {
+                shared_ptr<const HuffmanCodebook> codebook = CodebookRegistry::instance().open(codebookName);
+                codebook->encodeToFile(inputFile, outputFile, phases);
+                messages << "File successfully compressed with codebook " << HuffmanCodebook::idString(codebook->id()) << endl;
+            } else if (useBlocks) {
+                BlockContainerCoding parallel(threads.empty() ? 0 : stoul(threads),
+                                              blockSize.empty() ? BlockContainerCoding::DEFAULT_BLOCK_SIZE : stoul(blockSize),
+                                              codec);
+                parallel.encodeToFile(inputFile, outputFile);
+                phases = parallel.phaseTimes();
+                messages << "File successfully compressed" << endl;
+                messages << "blocks compressed on " << parallel.threadCount() << " threads" << endl;
+            } else {
+                HuffmanCoding huffman;
+                huffman.encodeToFile(inputFile, outputFile);
+                phases = huffman.phaseTimes();
+                messages << "File successfully compressed" << endl;
+            }
+            printCompressionStats(messages, inputFile, outputFile);
+            messages << "Text file compression completed successfully!" << endl;
 
         } else if (operation == "decompress") {
-            HuffmanCoding huffman;
-            huffman.decodeFromFile(inputFile, outputFile);
-            cout << "Text file decompression completed successfully!" << endl;
+            if (useCodebook) {
+                CodebookRegistry::instance().open(codebookName)->decodeFromFile(inputFile, outputFile, phases);
+            } else if (BlockContainerCoding::isBlockFile(inputFile)) {
+                BlockContainerCoding parallel(threads.empty() ? 0 : stoul(threads), BlockContainerCoding::MAX_BLOCK_SIZE);
+                parallel.decodeFromFile(inputFile, outputFile);
+                phases = parallel.phaseTimes();
+            } else {
+                HuffmanCoding huffman;
+                huffman.decodeFromFile(inputFile, outputFile);
+                phases = huffman.phaseTimes();
+            }
+            messages << "File successfully decompressed" << endl;
+            messages << "Text file decompression completed successfully!" << endl;
+        } else if (operation == "extract") {
+            if (argc < 6 || !BlockContainerCoding::isBlockFile(inputFile)) {
+                cerr << "extract needs an offset and a file compressed with --threads" << endl;
+                return 1;
+            }
+            int64_t offset = stoll(argv[5]);
+            uint64_t length = (argc > 6 && argv[6][0] != '-') ? stoull(argv[6]) : UINT64_MAX;
+            BlockContainerCoding parallel(threads.empty() ? 0 : stoul(threads), BlockContainerCoding::MAX_BLOCK_SIZE);
+            parallel.extractRange(inputFile, offset, length, outputFile);
+        } else if (operation == "train") {
+            vector<string> samples = HuffmanCodebook::samplesAt(inputFile);
+            HuffmanCodebook codebook = HuffmanCodebook::train(samples);
+            codebook.save(outputFile);
+            string headerFile;
+            if (findOption(argc, argv, 5, "header", headerFile)) {
+                codebook.saveHeader(headerFile);
+            }
+            cout << "Trained codebook " << HuffmanCodebook::idString(codebook.id()) << " on " << samples.size()
+                 << " sample files" << endl;
         } else {
-            cerr << "Invalid operation. Use 'compress' or 'decompress'." << endl;
+            cerr << "Invalid operation. Use 'compress', 'decompress', 'extract' or 'train'." << endl;
             return 1;
         }
     } else if (fileType == "jpeg") {
-        string quality = argv[5];
-               
-        JPEGCompressor jpegCompressor(inputFile, outputFile, stoi(quality));
-        jpegCompressor.compress();
-        cout << "JPEG compression completed successfully!" << endl;
-        long inputsize = getFileSize(inputFile);
-        long outputsize = getFileSize(outputFile);
-        cout<<"original file size:"<<inputsize<<" bytes"<<endl;
-        cout<<"compressed file size:"<<outputsize<<" bytes"<<endl;
-        double compressionPercentage = (static_cast<double>(outputsize) / inputsize) * 100;
-        cout << "Compression Percentage: " << compressionPercentage << "%" << endl;
+        unsigned int scaleDenominator;
+        JDIMENSION maxDimension;
+        if (!findDownscaleOptions(argc, argv, 5, scaleDenominator, maxDimension)) {
+            cerr << "--scale must be 1, 1/2, 1/4 or 1/8" << endl;
+            return 1;
+        }
+
+        if (operation == "batch") {
+            if (argc < 6) {
+                cerr << "JPEG batch compression needs a quality between 1 and 100" << endl;
+                return 1;
+            }
+            string threads;
+            findOption(argc, argv, 6, "threads", threads);
+            JPEGBatchCompressor batch(inputFile, outputFile, stoi(argv[5]), threads.empty() ? 0 : stoul(threads));
+            batch.setDownscale(scaleDenominator, maxDimension);
+            size_t failures = batch.run();
+            cout << "JPEG batch compression completed" << (failures ? " with errors" : " successfully!") << endl;
+            return failures ? 1 : 0;
+        } else if (operation == "target") {
+            if (argc < 6) {
+                cerr << "JPEG target-size compression needs a maximum size in bytes" << endl;
+                return 1;
+            }
+            JPEGCompressor jpegCompressor(inputFile, outputFile);
+            int chosenQuality = jpegCompressor.compressToSize(stoull(argv[5]));
+            phases = jpegCompressor.phaseTimes();
+            messages << "Selected quality: " << chosenQuality << endl;
+            messages << "JPEG target-size compression completed successfully!" << endl;
+        } else if (operation == "optimize") {
+            string unused;
+            JPEGCompressor jpegCompressor(inputFile, outputFile);
+            bool smaller = jpegCompressor.optimize(findOption(argc, argv, 5, "progressive", unused));
+            phases = jpegCompressor.phaseTimes();
+            if (!smaller) {
+                messages << "Optimized image was not smaller; the original was copied unchanged" << endl;
+            }
+            messages << "JPEG lossless optimization completed successfully!" << endl;
+        } else if (operation == "compress") {
+            if (argc < 6) {
+                cerr << "JPEG compression needs a quality between 1 and 100" << endl;
+                return 1;
+            }
+            string quality = argv[5];
+
+            JPEGCompressor jpegCompressor(inputFile, outputFile, stoi(quality));
+            jpegCompressor.setDownscale(scaleDenominator, maxDimension);
+            jpegCompressor.compress();
+            phases = jpegCompressor.phaseTimes();
+            messages << "JPEG compression completed successfully!" << endl;
+        } else {
+            cerr << "Invalid operation. Use 'compress', 'optimize', 'batch' or 'target'." << endl;
+            return 1;
+        }
+        printCompressionStats(messages, inputFile, outputFile);
     } else {
         cerr << "Invalid file type. Use 'text' or 'jpeg'." << endl;
         return 1;
     }
 
+    if (jsonStats) {
+        double seconds = chrono::duration<double>(PhaseTimer::now() - started).count();
+        printJSONStats(cout, fileType + " " + operation, inputFile, outputFile, seconds, phases);
+    }
     return 0;
 }
+
+#endif // COMPRESSOR_LIBRARY
@@ -0,0 +1,112 @@
+/*
+ * C interface to the compressor, for use from other languages and from programs that embed the codecs
+ * instead of launching compressor.exe. Build it as a shared library with COMPRESSOR_LIBRARY defined
+ * (see README.md).
+ *
+ * Every operation returns 0 on success and -1 on failure; compressor_last_error() then describes the
+ * failure. Errors are kept per thread, and JPEG operations reuse one set of libjpeg structs per calling
+ * thread, so the functions may be called from several threads at once. Buffers returned by the
+ * *_buffer functions are owned by the caller and must be released with compressor_free().
+ */
+#ifndef COMPRESSOR_API_H
+#define COMPRESSOR_API_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef _WIN32
+#ifdef COMPRESSOR_LIBRARY
+#define COMPRESSOR_API __declspec(dllexport)
+#else
+#define COMPRESSOR_API __declspec(dllimport)
+#endif
+#else
+#define COMPRESSOR_API __attribute__((visibility("default")))
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Bumped whenever a function or struct below changes incompatibly */
+#define COMPRESSOR_API_VERSION 2
+
+/* Sizes and timing of one operation; every stats argument may be NULL */
+typedef struct compressor_stats {
+    uint64_t input_bytes;  /* Bytes read */
+    uint64_t output_bytes; /* Bytes written */
+    double seconds;        /* Wall time of the operation */
+} compressor_stats;
+
+/* Returns the COMPRESSOR_API_VERSION the library was built with */
+COMPRESSOR_API int compressor_api_version(void);
+
+/* Message for the last failed call on this thread; valid until the next call on this thread */
+COMPRESSOR_API const char* compressor_last_error(void);
+
+/* Releases a buffer returned by one of the *_buffer functions */
+COMPRESSOR_API void compressor_free(void* buffer);
+
+/* Coders for the blocks of a text block container, as chosen by --codec on the command line */
+#define COMPRESSOR_CODEC_HUFFMAN 0 /* One Huffman table per block */
+#define COMPRESSOR_CODEC_ORDER1 1  /* Huffman tables chosen by the previous byte */
+#define COMPRESSOR_CODEC_TANS 2    /* Table-based asymmetric numeral systems */
+#define COMPRESSOR_CODEC_LZ77 3    /* LZ77 matches, then Huffman */
+#define COMPRESSOR_CODEC_BWT 4     /* Burrows-Wheeler transform, move-to-front, then Huffman */
+
+/*
+ * Text files. block_size 0 writes the single-stream (Huffman) format; otherwise the block container is
+ * written with blocks of block_size bytes, coded with codec (a COMPRESSOR_CODEC_* value) on threads
+ * workers (0 = one per core). Codecs other than COMPRESSOR_CODEC_HUFFMAN need a block_size.
+ * Decompression detects the format and codec; threads only applies to block containers.
+ */
+COMPRESSOR_API int compressor_text_compress_file(const char* input_path, const char* output_path,
+                                                 size_t block_size, unsigned int threads, int codec,
+                                                 compressor_stats* stats);
+COMPRESSOR_API int compressor_text_decompress_file(const char* input_path, const char* output_path,
+                                                   unsigned int threads, compressor_stats* stats);
+
+/* Text buffers, in the single-stream format (the output can also be saved and decoded as a file) */
+COMPRESSOR_API int compressor_text_compress_buffer(const void* input, size_t input_size, unsigned char** output,
+                                                   size_t* output_size, compressor_stats* stats);
+COMPRESSOR_API int compressor_text_decompress_buffer(const void* input, size_t input_size, unsigned char** output,
+                                                     size_t* output_size, compressor_stats* stats);
+
+/*
+ * Text buffers coded with a trained codebook (see "text train" in README.md), for small inputs that
+ * can't repay a code table of their own. compressor_codebook_load reads a codebook file, or the
+ * compiled-in codebook for "builtin", once per process and returns its ID. Each record names its
+ * codebook, so decompression looks the codebook up by that ID; it must have been loaded first.
+ * compressor_codebook_train does what "text train" does: it builds a codebook from a sample file, or from
+ * every regular file directly inside a sample directory, and writes it to codebook_path.
+ */
+COMPRESSOR_API int compressor_codebook_train(const char* sample_path, const char* codebook_path,
+                                             uint32_t* codebook_id);
+COMPRESSOR_API int compressor_codebook_load(const char* path, uint32_t* codebook_id);
+COMPRESSOR_API int compressor_text_compress_codebook_buffer(uint32_t codebook_id, const void* input, size_t input_size,
+                                                            unsigned char** output, size_t* output_size,
+                                                            compressor_stats* stats);
+COMPRESSOR_API int compressor_text_decompress_codebook_buffer(const void* input, size_t input_size,
+                                                              unsigned char** output, size_t* output_size,
+                                                              compressor_stats* stats);
+
+/* JPEG recompression at quality 1-100 */
+COMPRESSOR_API int compressor_jpeg_compress_file(const char* input_path, const char* output_path, int quality,
+                                                 compressor_stats* stats);
+COMPRESSOR_API int compressor_jpeg_compress_buffer(const void* input, size_t input_size, int quality,
+                                                   unsigned char** output, size_t* output_size,
+                                                   compressor_stats* stats);
+
+/* Lossless JPEG optimization; progressive non-zero also writes progressive scans. The input is
+   passed through unchanged when the rewritten image would not be smaller. */
+COMPRESSOR_API int compressor_jpeg_optimize_file(const char* input_path, const char* output_path, int progressive,
+                                                 compressor_stats* stats);
+COMPRESSOR_API int compressor_jpeg_optimize_buffer(const void* input, size_t input_size, int progressive,
+                                                   unsigned char** output, size_t* output_size,
+                                                   compressor_stats* stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* COMPRESSOR_API_H */
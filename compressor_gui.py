@@ -6,6 +6,67 @@ import subprocess
 import os
 import sys
 import threading
+import ctypes
+
+class CompressorStats(ctypes.Structure):
+    _fields_ = [
+        ("input_bytes", ctypes.c_uint64),
+        ("output_bytes", ctypes.c_uint64),
+        ("seconds", ctypes.c_double)
+    ]
+
+class CompressorLibrary:
+    """Runs operations in-process through the compressor shared library (see compressor_api.h)"""
+
+    API_VERSION = 2
+    CODEC_HUFFMAN = 0  # COMPRESSOR_CODEC_HUFFMAN
+
+    if sys.platform == "win32":
+        FILE_NAME = "compressor.dll"
+    elif sys.platform == "darwin":
+        FILE_NAME = "libcompressor.dylib"
+    else:
+        FILE_NAME = "libcompressor.so"
+
+    def __init__(self, directory):
+        self.lib = ctypes.CDLL(os.path.join(directory, self.FILE_NAME))
+        if self.lib.compressor_api_version() != self.API_VERSION:
+            raise OSError("Unsupported compressor library version")
+
+        stats = ctypes.POINTER(CompressorStats)
+        self.lib.compressor_last_error.restype = ctypes.c_char_p
+        self.lib.compressor_text_compress_file.argtypes = [
+            ctypes.c_char_p, ctypes.c_char_p, ctypes.c_size_t, ctypes.c_uint, ctypes.c_int, stats]
+        self.lib.compressor_text_decompress_file.argtypes = [
+            ctypes.c_char_p, ctypes.c_char_p, ctypes.c_uint, stats]
+        self.lib.compressor_jpeg_compress_file.argtypes = [
+            ctypes.c_char_p, ctypes.c_char_p, ctypes.c_int, stats]
+
+    def call(self, function, *args):
+        stats = CompressorStats()
+        if function(*args, ctypes.byref(stats)) != 0:
+            raise RuntimeError(f"Compression failed: {self.lib.compressor_last_error().decode(errors='replace')}")
+        return stats
+
+    def text(self, operation, input_path, output_path):
+        paths = (os.fsencode(input_path), os.fsencode(output_path))
+        if operation == "compress":
+            stats = self.call(self.lib.compressor_text_compress_file, *paths, 0, 0, self.CODEC_HUFFMAN)
+            return "File successfully compressed\n" + self.format_stats(stats)
+        self.call(self.lib.compressor_text_decompress_file, *paths, 0)
+        return "File successfully decompressed\n"
+
+    def jpeg(self, input_path, output_path, quality):
+        stats = self.call(self.lib.compressor_jpeg_compress_file,
+                          os.fsencode(input_path), os.fsencode(output_path), quality)
+        return "JPEG compression completed successfully!\n" + self.format_stats(stats)
+
+    @staticmethod
+    def format_stats(stats):
+        percentage = stats.output_bytes / stats.input_bytes * 100 if stats.input_bytes else 0
+        return (f"original file size:{stats.input_bytes} bytes\n"
+                f"compressed file size:{stats.output_bytes} bytes\n"
+                f"Compression Percentage: {percentage:g}%\n")
 
 class CompressorGUI:
     def __init__(self):
@@ -17,6 +78,12 @@ class CompressorGUI:
             self.application_path = os.path.dirname(sys.executable)
         else:
             self.application_path = os.path.dirname(os.path.abspath(__file__))
+
+        # Prefer the shared library; fall back to running compressor.exe when it is not available
+        try:
+            self.library = CompressorLibrary(self.application_path)
+        except OSError:
+            self.library = None
             
         self.setup_main_window()
         
@@ -94,15 +161,17 @@ class CompressorGUI:
             return
             
         try:
-            args = [
-                os.path.join(self.application_path, "compressor.exe"),
-                "text",
-                operation,
-                input_path,
-                output_path
-            ]
-            
-            output = self.run_compressor(args)
+            if self.library:
+                output = self.library.text(operation, input_path, output_path)
+            else:
+                args = [
+                    os.path.join(self.application_path, "compressor.exe"),
+                    "text",
+                    operation,
+                    input_path,
+                    output_path
+                ]
+                output = self.run_compressor(args)
             self.show_success_window(output)
             
         except Exception as e:
@@ -121,15 +190,18 @@ class CompressorGUI:
 
             def run_jpeg_compression():
                 try:
-                    args = [
-                        os.path.join(self.application_path, "compressor.exe"),
-                        "jpeg",
-                        "compress",
-                        input_path,
-                        output_path,
-                        str(quality)
-                    ]
-                    output = self.run_compressor(args)
+                    if self.library:
+                        output = self.library.jpeg(input_path, output_path, quality)
+                    else:
+                        args = [
+                            os.path.join(self.application_path, "compressor.exe"),
+                            "jpeg",
+                            "compress",
+                            input_path,
+                            output_path,
+                            str(quality)
+                        ]
+                        output = self.run_compressor(args)
                     self.root.after(0, lambda: self.show_success_window(output))
                 except Exception as e:
                     self.root.after(0, lambda: messagebox.showerror("Error", f"An error occurred: {str(e)}"))
@@ -0,0 +1,151 @@
+"""Checks that `compressor serve` answers corrupt text jobs with an error and keeps serving.
+
+Usage: python3 test_server.py [path/to/compressor]
+"""
+
+import os
+import random
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+import unittest
+
+COMPRESSOR = os.path.abspath(sys.argv.pop(1) if len(sys.argv) > 1 else "compressor.exe")
+
+class ServerTest(unittest.TestCase):
+    def setUp(self):
+        self.directory = tempfile.TemporaryDirectory()
+        self.socket_path = self.path("compressor.sock")
+        self.server = subprocess.Popen([COMPRESSOR, "serve", self.socket_path, "--threads=2"],
+                                       stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        for _ in range(100):
+            if os.path.exists(self.socket_path):
+                break
+            time.sleep(0.05)
+        self.connection = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self.connection.connect(self.socket_path)
+        self.replies = self.connection.makefile("r")
+
+    def tearDown(self):
+        self.replies.close()
+        self.connection.close()
+        self.server.kill()
+        self.server.wait()
+        self.directory.cleanup()
+
+    def path(self, name):
+        return os.path.join(self.directory.name, name)
+
+    def job(self, *fields):
+        self.connection.sendall(("\t".join(fields) + "\n").encode())
+        return self.replies.readline().rstrip("\n").split("\t")
+
+    # A block container with many small blocks, so decoding has tasks queued when one fails
+    def block_container(self, original, codec="huffman"):
+        words = ["alpha", "beta", "gamma", "delta", "epsilon", "zeta", "eta", "theta"]
+        generator = random.Random(1)
+        with open(original, "w") as file:
+            file.write(" ".join(generator.choice(words) for _ in range(400000)))
+        encoded = self.path("container.bin")
+        subprocess.run([COMPRESSOR, "text", "compress", original, encoded, "--block-size=65536", "--threads=2",
+                        "--codec=" + codec], check=True, stdout=subprocess.DEVNULL)
+        with open(encoded, "rb") as file:
+            return file.read()
+
+    # Every codec stores the uint64 bit length right before the packed bits, so it is the last header
+    # field whose value matches the number of bytes that follow it
+    @staticmethod
+    def with_huge_bit_length(data, start, size):
+        damaged = bytearray(data)
+        for offset in range(start + size - 8, start - 1, -1):
+            (bit_length,) = struct.unpack_from("<Q", data, offset)
+            if (bit_length + 7) // 8 == start + size - offset - 8:
+                struct.pack_into("<Q", damaged, offset, 2**64 - 1)
+                return bytes(damaged)
+        raise AssertionError("bit length not found")
+
+    def assert_rejected(self, data, message):
+        with open(self.path("corrupt.bin"), "wb") as file:
+            file.write(data)
+        start = time.monotonic()
+        reply = self.job("text", "decompress", self.path("corrupt.bin"), self.path("restored.txt"))
+        self.assertEqual(reply[0], "error", message)
+        self.assertLess(time.monotonic() - start, 5, message)
+        self.assertIsNone(self.server.poll(), message)
+
+    def test_corrupt_text_jobs_keep_server_alive(self):
+        original = self.path("original.txt")
+        container = self.block_container(original)
+        corrupt_inputs = [bytes(random.Random(2).randrange(256) for _ in range(4096)), container[:len(container) // 2]]
+        # Scattered bit flips fail some block after others are already queued
+        generator = random.Random(3)
+        for _ in range(100):
+            damaged = bytearray(container)
+            for _ in range(20):
+                damaged[generator.randrange(10, len(damaged) // 2)] ^= generator.randrange(1, 256)
+            corrupt_inputs.append(bytes(damaged))
+
+        for number, data in enumerate(corrupt_inputs):
+            with open(self.path("corrupt.bin"), "wb") as file:
+                file.write(data)
+            reply = self.job("text", "decompress", self.path("corrupt.bin"), self.path("restored.txt"))
+            self.assertEqual(reply[0], "error", number)
+            self.assertIsNone(self.server.poll(), number)
+
+        reply = self.job("text", "decompress", self.path("container.bin"), self.path("restored.txt"))
+        self.assertEqual(reply[0], "ok")
+        with open(original, "rb") as expected, open(self.path("restored.txt"), "rb") as restored:
+            self.assertEqual(expected.read(), restored.read())
+
+    def test_huge_bit_length_is_rejected(self):
+        original = self.path("original.txt")
+        for codec in ["huffman", "order1", "tans", "lz77", "bwt"]:
+            container = self.block_container(original, codec)
+            index_offset = struct.unpack_from("<Q", container, len(container) - 20)[0]
+            record_offset, record_size = struct.unpack_from("<QQ", container, index_offset)
+            self.assert_rejected(self.with_huge_bit_length(container, record_offset, record_size), codec)
+
+        # Single-stream file: the bit length follows the code table and runs to the end of the file
+        stream = self.path("stream.bin")
+        subprocess.run([COMPRESSOR, "text", "compress", original, stream], check=True, stdout=subprocess.DEVNULL)
+        with open(stream, "rb") as file:
+            data = file.read()
+        self.assert_rejected(self.with_huge_bit_length(data, 13, len(data) - 13), "single stream")
+
+        reply = self.job("text", "decompress", stream, self.path("restored.txt"))
+        self.assertEqual(reply[0], "ok")
+
+    def test_idle_clients_do_not_block_jobs(self):
+        # More idle connections than the server has workers
+        idle = []
+        for _ in range(4):
+            client = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+            client.connect(self.socket_path)
+            idle.append(client)
+        original = self.path("original.txt")
+        with open(original, "w") as file:
+            file.write("idle clients must not hold a worker\n" * 100)
+        # A connection opened after the idle ones still gets its job run
+        late = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        late.settimeout(5)
+        late.connect(self.socket_path)
+        late.sendall(("\t".join(["text", "compress", original, self.path("encoded.bin")]) + "\n").encode())
+        self.assertEqual(late.recv(4096).split(b"\t")[0], b"ok")
+        for client in idle + [late]:
+            client.close()
+
+    def test_refuses_to_replace_a_file_that_is_not_a_socket(self):
+        victim = self.path("victim.txt")
+        with open(victim, "w") as file:
+            file.write("precious")
+        result = subprocess.run([COMPRESSOR, "serve", victim], stdout=subprocess.DEVNULL,
+                                stderr=subprocess.DEVNULL, timeout=5)
+        self.assertNotEqual(result.returncode, 0)
+        with open(victim) as file:
+            self.assertEqual(file.read(), "precious")
+
+if __name__ == "__main__":
+    unittest.main()